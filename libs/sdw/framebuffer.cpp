@@ -0,0 +1,520 @@
+#include "sdw/framebuffer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace sdw {
+
+  namespace {
+    const size_t CACHE_LINE = 64;
+    const size_t HUGE_PAGE = 2 * 1024 * 1024;
+    // buffers larger than this are cleared without going through the cache,
+    // as they would only evict everything else before the first write
+    const size_t STREAM_THRESHOLD = 1024 * 1024;
+
+    // cache line aligned so rows and SIMD clears never split a line
+    void *allocate(size_t bytes, bool hugepages) {
+      size_t alignment =
+          hugepages && bytes >= HUGE_PAGE ? HUGE_PAGE : CACHE_LINE;
+      bytes = (bytes + alignment - 1) / alignment * alignment;
+
+      void *ptr = nullptr;
+      if (posix_memalign(&ptr, alignment, bytes) != 0) {
+        throw std::bad_alloc();
+      }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+      if (alignment == HUGE_PAGE) {
+        // only a hint, transparent huge pages may be disabled
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+      }
+#endif
+      return ptr;
+    }
+
+    // 16 bytes at a time, whole buffers past STREAM_THRESHOLD bypass the
+    // cache and anything smaller, such as a row of a tile which is about to
+    // be drawn into, goes through it
+    template <typename T> void fill(T *buffer, T value, size_t count) {
+      static_assert(16 % sizeof(T) == 0 || sizeof(T) == 3,
+                    "fill only handles 2^n byte types and packed 24 bits");
+      size_t i = 0;
+#ifdef __SSE2__
+      // a whole number of values to each run of vectors, 16 of a 3 byte type
+      // span 3 of them
+      const size_t lanes = 16 % sizeof(T) == 0 ? 16 / sizeof(T) : 16;
+      const size_t vectors = lanes * sizeof(T) / 16;
+      T bits[lanes];
+      std::fill_n(bits, lanes, value);
+      __m128i v[3];
+      for (size_t k = 0; k < vectors; k++) {
+        v[k] = _mm_loadu_si128(reinterpret_cast<__m128i *>(bits) + k);
+      }
+      if (count * sizeof(T) >= STREAM_THRESHOLD) {
+        // buffers come from allocate so are already 16 byte aligned
+        for (; i + 4 * lanes <= count; i += 4 * lanes) {
+          __m128i *line = reinterpret_cast<__m128i *>(buffer + i);
+          for (size_t k = 0; k < 4 * vectors; k++) {
+            _mm_stream_si128(line + k, v[k % vectors]);
+          }
+        }
+        _mm_sfence();
+      } else {
+        // rows start wherever the stride puts them
+        for (; i + lanes <= count; i += lanes) {
+          __m128i *line = reinterpret_cast<__m128i *>(buffer + i);
+          for (size_t k = 0; k < vectors; k++) {
+            _mm_storeu_si128(line + k, v[k]);
+          }
+        }
+      }
+#endif
+      for (; i < count; i++) {
+        buffer[i] = value;
+      }
+    }
+
+    // stale tiles are known to be clear and are never read to be hashed
+    const uint64_t CLEAR_HASH = 0;
+    const uint64_t UNKNOWN_HASH = ~0ull;
+    const uint64_t FNV_BASIS = 14695981039346656037ull;
+    const uint64_t FNV_PRIME = 1099511628211ull;
+
+    uint32_t clamp(const glm::vec3 &colour) {
+      return glmt::rgbf01(glm::clamp(colour, 0.f, 1.f)).argb8888();
+    }
+
+    // the usual rotated grids in 1/16ths of a pixel, so edges close to
+    // horizontal or vertical still cross samples at different points
+    const glm::vec2 PATTERN_1[] = {{0, 0}};
+    const glm::vec2 PATTERN_2[] = {{4 / 16.f, 4 / 16.f},
+                                   {-4 / 16.f, -4 / 16.f}};
+    const glm::vec2 PATTERN_4[] = {{-2 / 16.f, -6 / 16.f},
+                                   {6 / 16.f, -2 / 16.f},
+                                   {-6 / 16.f, 2 / 16.f},
+                                   {2 / 16.f, 6 / 16.f}};
+    const glm::vec2 PATTERN_8[] = {
+        {1 / 16.f, -3 / 16.f}, {-1 / 16.f, 3 / 16.f}, {5 / 16.f, 1 / 16.f},
+        {-3 / 16.f, -5 / 16.f}, {-5 / 16.f, 5 / 16.f}, {-7 / 16.f, -1 / 16.f},
+        {3 / 16.f, 7 / 16.f},   {7 / 16.f, -7 / 16.f}};
+  } // namespace
+
+  const unsigned int framebuffer::TILE;
+  const unsigned int framebuffer::BLOCK;
+  const uint32_t framebuffer::HDR;
+
+  // Simple constructor method
+  framebuffer::framebuffer() {}
+
+  // Complex constructor method
+  framebuffer::framebuffer(int w, int h, bool hugepages,
+                           unsigned int samples)
+      : samples(samples) {
+    switch (samples) {
+    case 1:
+      pattern = PATTERN_1;
+      break;
+    case 2:
+      pattern = PATTERN_2;
+      break;
+    case 4:
+      pattern = PATTERN_4;
+      break;
+    case 8:
+      pattern = PATTERN_8;
+      break;
+    default:
+      throw std::invalid_argument("framebuffer samples must be 1, 2, 4 or 8");
+    }
+    width = maxWidth = w;
+    height = maxHeight = h;
+    tonemap = clamp;
+    // whole blocks, the padding past the edges is never shown
+    stride = (width + BLOCK - 1) / BLOCK * BLOCK;
+    const size_t size = stride * ((height + BLOCK - 1) / BLOCK * BLOCK);
+    pixelBuffer = static_cast<uint32_t *>(
+        allocate(size * sizeof(uint32_t), hugepages));
+    depthBuffer = static_cast<depth_format::type *>(
+        allocate(size * sizeof(depth_format::type), hugepages));
+    // not part of clears, it only means something where pixelBuffer is HDR
+    hdrBuffer = static_cast<glm::vec3 *>(
+        allocate(size * sizeof(glm::vec3), hugepages));
+    std::fill_n(hdrBuffer, size, glm::vec3(0));
+    sampleDepth = nullptr;
+    sampleColour = nullptr;
+    if (samples > 1) {
+      sampleDepth = static_cast<depth_format::type *>(
+          allocate(size * samples * sizeof(depth_format::type), hugepages));
+      sampleColour = static_cast<uint32_t *>(
+          allocate(size * samples * sizeof(uint32_t), hugepages));
+      fill(sampleDepth, depth_format::clear(), size * samples);
+    }
+
+    // the only eager clear, every tile starts out holding the clear value
+    tilesX = (width + TILE - 1) / TILE;
+    tilesY = (height + TILE - 1) / TILE;
+    tiles = new std::atomic<uint8_t>[tilesX * tilesY];
+    hashes = new uint64_t[tilesX * tilesY];
+    for (size_t i = 0; i < tilesX * tilesY; i++) {
+      tiles[i].store(0);
+      hashes[i] = UNKNOWN_HASH;
+    }
+    fill(pixelBuffer, uint32_t(0), size);
+    fill(depthBuffer, depth_format::clear(), size);
+  }
+
+  void framebuffer::resize(int w, int h) {
+    width = std::min<unsigned int>(w, maxWidth);
+    height = std::min<unsigned int>(h, maxHeight);
+    stride = (width + BLOCK - 1) / BLOCK * BLOCK;
+
+    // rows are now a different length so everything drawn is meaningless,
+    // which the lazy clear takes care of
+    tilesX = (width + TILE - 1) / TILE;
+    tilesY = (height + TILE - 1) / TILE;
+    for (size_t i = 0; i < tilesX * tilesY; i++) {
+      tiles[i].store(COLOUR_STALE | DEPTH_STALE | SAMPLES_STALE);
+      hashes[i] = UNKNOWN_HASH;
+    }
+  }
+
+  // Deconstructor method
+  void framebuffer::destroy() {
+    free(pixelBuffer);
+    free(depthBuffer);
+    free(hdrBuffer);
+    free(sampleDepth);
+    free(sampleColour);
+    delete[] tiles;
+    delete[] hashes;
+  }
+
+  void framebuffer::resolve(unsigned int t, uint8_t stale) {
+    while (true) {
+      uint8_t state = tiles[t].load(std::memory_order_acquire);
+      if (!(state & stale)) {
+        return;
+      }
+      if (state & LOCKED) {
+        continue; // another thread is clearing it
+      }
+      if (tiles[t].compare_exchange_weak(state, state | LOCKED,
+                                         std::memory_order_acquire)) {
+        break;
+      }
+    }
+
+    const unsigned int x0 = (t % tilesX) * TILE;
+    const unsigned int y0 = (t / tilesX) * TILE;
+    // padding included, the blocks along each band of rows are one run
+    const unsigned int w =
+        (std::min(TILE, width - x0) + BLOCK - 1) / BLOCK * BLOCK * BLOCK;
+    const unsigned int h = std::min(TILE, height - y0);
+    for (unsigned int y = y0; y < y0 + h; y += BLOCK) {
+      const unsigned int p = index(x0, y);
+      if (stale == COLOUR_STALE) {
+        fill(pixelBuffer + p, uint32_t(0), w);
+      } else if (stale == SAMPLES_STALE) {
+        fill(sampleDepth + p * samples, depth_format::clear(), w * samples);
+      } else {
+        fill(depthBuffer + p, depth_format::clear(), w);
+      }
+    }
+
+    if (stale == COLOUR_STALE) {
+      // the old frame's colour is gone, which damage() has to hash again
+      tiles[t].fetch_or(COLOUR_CHANGED, std::memory_order_relaxed);
+    }
+    tiles[t].fetch_and(~(stale | LOCKED), std::memory_order_release);
+  }
+
+  void framebuffer::invalidate(uint8_t stale, uint8_t written) {
+    for (size_t i = 0; i < tilesX * tilesY; i++) {
+      uint8_t state = tiles[i].load(std::memory_order_relaxed);
+      if (state & written) {
+        // untouched tiles still hold the clear value and stay as they are
+        tiles[i].store((state & ~written) | stale, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void framebuffer::resolve() {
+    for (size_t i = 0; i < tilesX * tilesY; i++) {
+      resolve(i, COLOUR_STALE);
+    }
+  }
+
+  void framebuffer::resolveSamples(unsigned int p) {
+    const depth_format::type *depths = sampleDepth + p * samples;
+    const uint32_t *colours = sampleColour + p * samples;
+
+    uint32_t pixel = pixelBuffer[p];
+    if (pixel == HDR) {
+      pixel = tonemap(hdrBuffer[p]);
+    }
+    depth_format::type nearest = depthBuffer[p];
+    // sums of the red, green and blue of argb8888, at most 8 * 255 so never
+    // overflow
+    uint32_t sums[3] = {0, 0, 0};
+    bool covered = false;
+    for (unsigned int i = 0; i < samples; i++) {
+      uint32_t c = pixel;
+      if (depths[i] != depth_format::clear() &&
+          depth_format::closer(depthBuffer[p], depths[i])) {
+        c = colours[i];
+        covered = true;
+        if (depth_format::closer(nearest, depths[i])) {
+          nearest = depths[i];
+        }
+      }
+      for (unsigned int ch = 0; ch < 3; ch++) {
+        sums[ch] += c >> (8 * ch) & 0xff;
+      }
+    }
+    if (!covered) {
+      return;
+    }
+
+    // opaque, even where the cleared background with no alpha stood in for
+    // some of the samples, as anything blending it would darken the edge
+    // again
+    uint32_t resolved = 0xff000000;
+    for (unsigned int ch = 0; ch < 3; ch++) {
+      resolved |= (sums[ch] + samples / 2) / samples << (8 * ch);
+    }
+    pixelBuffer[p] = resolved;
+    depthBuffer[p] = nearest;
+  }
+
+  void framebuffer::resolveSamples() {
+    if (samples == 1) {
+      return;
+    }
+    for (unsigned int t = 0; t < tilesX * tilesY; t++) {
+      const uint8_t state = tiles[t].load(std::memory_order_acquire);
+      if ((state & (SAMPLES_STALE | SAMPLES_WRITTEN)) != SAMPLES_WRITTEN) {
+        continue; // nothing was rasterised into it
+      }
+      touch(t, COLOUR_STALE, COLOUR_WRITTEN | COLOUR_CHANGED);
+      touch(t, DEPTH_STALE, DEPTH_WRITTEN);
+
+      const unsigned int x0 = (t % tilesX) * TILE;
+      const unsigned int y0 = (t / tilesX) * TILE;
+      const unsigned int w = std::min(TILE, width - x0);
+      const unsigned int h = std::min(TILE, height - y0);
+      for (unsigned int y = y0; y < y0 + h; y++) {
+        for (unsigned int x = x0; x < x0 + w; x++) {
+          resolveSamples(index(x, y));
+        }
+      }
+    }
+    invalidate(SAMPLES_STALE, SAMPLES_WRITTEN);
+  }
+
+  void framebuffer::resolveSamples(glmt::vec2p pos) {
+    if (samples == 1) {
+      return;
+    }
+    const unsigned int t = tile(pos.x, pos.y);
+    const uint8_t state = tiles[t].load(std::memory_order_acquire);
+    if ((state & (SAMPLES_STALE | SAMPLES_WRITTEN)) != SAMPLES_WRITTEN) {
+      return;
+    }
+    touch(t, COLOUR_STALE, COLOUR_WRITTEN | COLOUR_CHANGED);
+    touch(t, DEPTH_STALE, DEPTH_WRITTEN);
+    const unsigned int p = index(pos.x, pos.y);
+    resolveSamples(p);
+    std::fill_n(sampleDepth + p * samples, samples, depth_format::clear());
+  }
+
+  void framebuffer::copyPixels(uint32_t *dst, unsigned int pitch,
+                               rect area) const {
+    const unsigned int end = area.x + area.w;
+    for (unsigned int y = area.y; y < area.y + area.h; y++) {
+      for (unsigned int x = area.x; x < end; x = (x / TILE + 1) * TILE) {
+        const unsigned int w = std::min((x / TILE + 1) * TILE, end) - x;
+        if (tiles[tile(x, y)].load(std::memory_order_acquire) & COLOUR_STALE) {
+          fill(dst + y * pitch + x, uint32_t(0), w);
+        } else {
+          for (unsigned int i = x, n; i < x + w; i += n) {
+            n = run(i, x + w - i);
+            std::memcpy(dst + y * pitch + i, pixelBuffer + index(i, y),
+                        n * sizeof(uint32_t));
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<framebuffer::rect> framebuffer::damage() {
+    return damage(*this);
+  }
+
+  std::vector<framebuffer::rect>
+  framebuffer::damage(const framebuffer &last) {
+    std::vector<rect> damaged;
+    for (unsigned int ty = 0; ty < tilesY; ty++) {
+      const unsigned int y = ty * TILE;
+      const unsigned int h = std::min(TILE, height - y);
+      for (unsigned int tx = 0; tx < tilesX; tx++) {
+        const unsigned int x = tx * TILE;
+        const unsigned int w = std::min(TILE, width - x);
+        const unsigned int t = ty * tilesX + tx;
+
+        // only tiles drawn into since the last call can hash differently
+        const uint8_t state = tiles[t].load(std::memory_order_acquire);
+        uint64_t hash = hashes[t];
+        if (state & COLOUR_STALE) {
+          hash = CLEAR_HASH;
+        } else if (state & COLOUR_CHANGED || hash == UNKNOWN_HASH) {
+          tiles[t].fetch_and(uint8_t(~COLOUR_CHANGED),
+                             std::memory_order_relaxed);
+          // fnv-1a over whole pixels, collisions only cost a missed update,
+          // in four lanes so the multiplies do not wait on each other
+          uint64_t lane[4] = {FNV_BASIS, FNV_BASIS, FNV_BASIS, FNV_BASIS};
+          for (unsigned int row = y; row < y + h; row++) {
+            unsigned int col = x;
+            // x is a whole number of blocks, so each four are contiguous
+            for (; col + 4 <= x + w; col += 4) {
+              const uint32_t *p = pixelBuffer + index(col, row);
+              lane[0] = (lane[0] ^ p[0]) * FNV_PRIME;
+              lane[1] = (lane[1] ^ p[1]) * FNV_PRIME;
+              lane[2] = (lane[2] ^ p[2]) * FNV_PRIME;
+              lane[3] = (lane[3] ^ p[3]) * FNV_PRIME;
+            }
+            for (; col < x + w; col++) {
+              lane[0] = (lane[0] ^ pixelBuffer[index(col, row)]) * FNV_PRIME;
+            }
+          }
+          hash = FNV_BASIS;
+          for (unsigned int i = 0; i < 4; i++) {
+            hash = (hash ^ lane[i]) * FNV_PRIME;
+          }
+        }
+        const bool same = hash == last.hashes[t];
+        hashes[t] = hash;
+        if (same) {
+          continue;
+        }
+
+        // runs of changed tiles along a row become one rect
+        if (!damaged.empty() && damaged.back().y == y &&
+            damaged.back().x + damaged.back().w == x) {
+          damaged.back().w += w;
+        } else {
+          damaged.push_back(rect{x, y, w, h});
+        }
+      }
+    }
+    return damaged;
+  }
+
+  void framebuffer::setPixelColour(glmt::vec2p pos, uint32_t colour) {
+    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
+      // std::cout << x << "," << y << " not on visible screen area" <<
+      // std::endl;
+    } else {
+      // drawn over whatever is there, samples included
+      resolveSamples(pos);
+      touch(tile(pos.x, pos.y), COLOUR_STALE, COLOUR_WRITTEN | COLOUR_CHANGED);
+      pixelBuffer[index(pos.x, pos.y)] = colour;
+    }
+  }
+
+  void framebuffer::setPixelColour(glmt::vec2p pos, float invz,
+                                   const uint32_t colour) {
+    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
+      // std::cout << x << "," << y << " not on visible screen area" <<
+      // std::endl;
+    } else {
+      const unsigned int t = tile(pos.x, pos.y);
+      const depth_format::type depth =
+          tiles[t].load(std::memory_order_acquire) & DEPTH_STALE
+              ? depth_format::clear()
+              : depthBuffer[index(pos.x, pos.y)];
+      const depth_format::type d = depth_format::encode(invz);
+      if (depth_format::closer(depth, d)) {
+        touch(t, DEPTH_STALE, DEPTH_WRITTEN);
+        touch(t, COLOUR_STALE, COLOUR_WRITTEN | COLOUR_CHANGED);
+        depthBuffer[index(pos.x, pos.y)] = d;
+        pixelBuffer[index(pos.x, pos.y)] = colour;
+      }
+    }
+  }
+
+  void framebuffer::setPixelColour(glmt::vec2p pos, float invz,
+                                   const glm::vec3 colour) {
+    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
+      // std::cout << x << "," << y << " not on visible screen area" <<
+      // std::endl;
+    } else {
+      const unsigned int t = tile(pos.x, pos.y);
+      const depth_format::type depth =
+          tiles[t].load(std::memory_order_acquire) & DEPTH_STALE
+              ? depth_format::clear()
+              : depthBuffer[index(pos.x, pos.y)];
+      const depth_format::type d = depth_format::encode(invz);
+      if (depth_format::closer(depth, d)) {
+        touch(t, DEPTH_STALE, DEPTH_WRITTEN);
+        touch(t, COLOUR_STALE, COLOUR_WRITTEN | COLOUR_CHANGED);
+        depthBuffer[index(pos.x, pos.y)] = d;
+        pixelBuffer[index(pos.x, pos.y)] = HDR;
+        hdrBuffer[index(pos.x, pos.y)] = colour;
+      }
+    }
+  }
+
+  glmt::rgba8888 framebuffer::getPixelColour(glmt::vec2p pos) {
+    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
+      // std::cout << x << "," << y << " not on visible screen area" <<
+      // std::endl;
+      return glmt::rgba8888::fromargb8888packed(
+          -1); // TODO: return maybe? add semantics to vec2s?
+    }
+    resolveSamples(pos); // so blending sees the edges
+    if (tiles[tile(pos.x, pos.y)].load(std::memory_order_acquire) &
+        COLOUR_STALE) {
+      return glmt::rgba8888::fromargb8888packed(0);
+    } else if (pixelBuffer[index(pos.x, pos.y)] == HDR) {
+      return glmt::rgba8888::fromargb8888packed(
+          tonemap(hdrBuffer[index(pos.x, pos.y)]));
+    } else {
+      return glmt::rgba8888::fromargb8888packed(
+          pixelBuffer[index(pos.x, pos.y)]);
+    }
+  }
+
+  float framebuffer::getDepthBuffer(glmt::vec2p pos) {
+    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
+      return 1;
+    } else if (tiles[tile(pos.x, pos.y)].load(std::memory_order_acquire) &
+               DEPTH_STALE) {
+      return 0;
+    } else {
+      return depth_format::invz(depthBuffer[index(pos.x, pos.y)]);
+    }
+  }
+
+  void framebuffer::clearPixels() {
+    invalidate(COLOUR_STALE, COLOUR_WRITTEN);
+  }
+
+  // INVZ32F captures 1/z, instead of z as suggested so
+  // std::numeric_limits<float>::infinity() is not used nothing on screen is
+  // the same as every point being infinity far away 1/inf = 0, see sdw/depth.h
+  // for the others
+  void framebuffer::clearDepthBuffer() {
+    invalidate(DEPTH_STALE, DEPTH_WRITTEN);
+    invalidate(SAMPLES_STALE, SAMPLES_WRITTEN);
+  }
+
+} // namespace sdw
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+
+// the depth format is fixed at build time, eg -DSDW_DEPTH_FORMAT=UNORM16, so
+// every depth test is specialised for it rather than switching per fragment
+#ifndef SDW_DEPTH_FORMAT
+#define SDW_DEPTH_FORMAT INVZ32F
+#endif
+// the near and far planes of the perspective projection, which the formats
+// storing window z need to put it back together, eg -DSDW_DEPTH_FAR=200
+#ifndef SDW_DEPTH_NEAR
+#define SDW_DEPTH_NEAR 0.1
+#endif
+#ifndef SDW_DEPTH_FAR
+#define SDW_DEPTH_FAR 100.0
+#endif
+
+namespace sdw {
+
+  const double DEPTH_NEAR = SDW_DEPTH_NEAR;
+  const double DEPTH_FAR = SDW_DEPTH_FAR;
+
+  // window z in [0, 1], as glm::project gives it, of a point at view space
+  // depth z over [DEPTH_NEAR, DEPTH_FAR]
+  inline double window_z(float invz) {
+    return DEPTH_FAR / (DEPTH_FAR - DEPTH_NEAR) * (1 - DEPTH_NEAR * invz);
+  }
+
+  // callers always hand over 1/z of the view space depth z, the w of clip
+  // space, which is linear in screen space and keeps its precision however
+  // far away, each format turns that into what it stores
+  enum class DEPTH_FORMAT {
+    INVZ32F,     // 1/z as a float, 0 is cleared
+    UNORM16,     // window z as 16 bit unorm, half the bandwidth
+    UNORM24,     // window z as 24 bit unorm, packed into 3 bytes
+    UNORM32,     // window z as 32 bit unorm
+    REVERSED32F, // 1 - window z as a float, most precision far away
+  };
+
+  // little endian, so a buffer of them is 3 bytes a pixel
+  struct uint24 {
+    uint8_t bytes[3];
+
+    uint24() = default;
+    uint24(uint32_t v)
+        : bytes{uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16)} {}
+    operator uint32_t() const {
+      return bytes[0] | bytes[1] << 8 | uint32_t(bytes[2]) << 16;
+    }
+  };
+  static_assert(sizeof(uint24) == 3, "uint24 has to be packed");
+
+  template <DEPTH_FORMAT F> struct depth;
+
+  // closer means the incoming fragment should be written, later fragments win
+  // ties so coplanar geometry drawn on top shows
+  template <> struct depth<DEPTH_FORMAT::INVZ32F> {
+    typedef float type;
+    static type clear() { return 0; }
+    static type encode(float invz) { return invz; }
+    static float invz(type d) { return d; }
+    static bool closer(type depth, type incoming) {
+      return 0.0000001f >= depth - incoming; // threshold
+    }
+  };
+
+  template <typename T, uint64_t MAX> struct unorm_depth {
+    typedef T type;
+    static type clear() { return MAX; }
+    static type encode(float invz) {
+      // 1/0 is infinitely far and clamps to the clear value
+      const double z = invz > 0 ? window_z(invz) : 1.0;
+      if (z >= 1.0) {
+        return clear();
+      }
+      return z <= 0.0 ? T(0) : static_cast<T>(z * MAX + 0.5);
+    }
+    static float invz(type d) {
+      // and the clear value back to infinitely far
+      const double z = static_cast<uint32_t>(d) / double(MAX);
+      const double range = (DEPTH_FAR - DEPTH_NEAR) / DEPTH_FAR;
+      return z < 1.0 ? (1 - z * range) / DEPTH_NEAR : 0;
+    }
+    static bool closer(type depth, type incoming) { return incoming <= depth; }
+  };
+
+  template <>
+  struct depth<DEPTH_FORMAT::UNORM16> : unorm_depth<uint16_t, 0xffff> {};
+  template <>
+  struct depth<DEPTH_FORMAT::UNORM24> : unorm_depth<uint24, 0xffffff> {};
+  template <>
+  struct depth<DEPTH_FORMAT::UNORM32> : unorm_depth<uint32_t, 0xffffffff> {};
+
+  // 1 - window z is n / (f - n) * (f / z - 1), taken straight from 1/z rather
+  // than from window z, which has already lost all but a few bits near 1
+  template <> struct depth<DEPTH_FORMAT::REVERSED32F> {
+    typedef float type;
+    static float scale() {
+      return float(DEPTH_NEAR / (DEPTH_FAR - DEPTH_NEAR));
+    }
+    static type clear() { return 0; }
+    static type encode(float invz) {
+      // anything past the far plane clamps to the clear value, like unorm
+      const float d = scale() * (float(DEPTH_FAR) * invz - 1);
+      return d > 0 ? d : 0;
+    }
+    static float invz(type d) {
+      return d > 0 ? (d / scale() + 1) / float(DEPTH_FAR) : 0;
+    }
+    static bool closer(type depth, type incoming) { return incoming >= depth; }
+  };
+
+  typedef depth<DEPTH_FORMAT::SDW_DEPTH_FORMAT> depth_format;
+
+} // namespace sdw
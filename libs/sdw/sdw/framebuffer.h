@@ -0,0 +1,247 @@
+#pragma once
+#include "glmt.hpp"
+#include "sdw/depth.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// the pixel layout is fixed at build time too, -DSDW_TILED=1 stores each 8x8
+// block of pixels contiguously instead of whole rows, so a triangle touches
+// fewer cache lines and pages
+#ifndef SDW_TILED
+#define SDW_TILED 0
+#endif
+
+namespace sdw {
+
+  // colour and depth buffers which everything renders into, presenting them is
+  // left to sdw::window so rendering works without SDL
+  //
+  // clearing is lazy, clearPixels and clearDepthBuffer only flag the tiles
+  // which were written to since the last clear, and a flagged tile is cleared
+  // when it is next written to or when pixels() is read back
+  //
+  // with more than one sample per pixel triangles can be rasterised into
+  // per sample depth and colour instead, see resolveSamples
+  //
+  // pixels are only addressed through index() and span::at() so the layout
+  // can be row major or blocked, copyPixels and getPixelColour detile
+  class framebuffer {
+
+  public:
+    static const unsigned int TILE = 32; // tile width and height in pixels
+    // width and height of the blocks pixels are stored in, 1 is row major
+    static const unsigned int BLOCK = SDW_TILED ? 8 : 1;
+    // stands in for a pixel whose colour is still unmapped in the HDR buffer,
+    // argb8888 never packs an alpha of 0
+    static const uint32_t HDR = 0x00000001;
+
+  protected:
+    enum TILE_STATE : uint8_t {
+      COLOUR_STALE = 1 << 0, // logically clear, memory holds an old frame
+      DEPTH_STALE = 1 << 1,
+      COLOUR_WRITTEN = 1 << 2, // memory no longer holds the clear value
+      DEPTH_WRITTEN = 1 << 3,
+      LOCKED = 1 << 4, // being cleared by another thread
+      SAMPLES_STALE = 1 << 5, // only the sample depth is ever cleared
+      SAMPLES_WRITTEN = 1 << 6,
+      COLOUR_CHANGED = 1 << 7, // written to since damage() last hashed it
+    };
+
+    uint32_t *pixelBuffer;
+    depth_format::type *depthBuffer;
+    glm::vec3 *hdrBuffer; // linear colour, tone mapped once per frame
+    // samples per pixel next to each other, only meaningful where covered
+    depth_format::type *sampleDepth;
+    uint32_t *sampleColour; // argb8888, tone mapped when written
+    const glm::vec2 *pattern;
+    std::atomic<uint8_t> *tiles;
+    unsigned int tilesX;
+    unsigned int tilesY;
+    // of each colour tile as of the last damage(), still its hash unless
+    // it is COLOUR_STALE or COLOUR_CHANGED
+    uint64_t *hashes;
+    unsigned int maxWidth; // what the buffers were allocated for
+    unsigned int maxHeight;
+    unsigned int stride; // pixels per row of the buffers, width rounded up
+
+    // where row y and column x start, together where the pixel is
+    unsigned int rowOffset(unsigned int y) const {
+      return (y / BLOCK) * stride * BLOCK + (y % BLOCK) * BLOCK;
+    }
+    static unsigned int column(unsigned int x) {
+      return (x / BLOCK) * BLOCK * BLOCK + x % BLOCK;
+    }
+    unsigned int index(unsigned int x, unsigned int y) const {
+      return rowOffset(y) + column(x);
+    }
+    // how many pixels from x on are contiguous in memory, at most n
+    static unsigned int run(unsigned int x, unsigned int n) {
+      return BLOCK == 1 ? n : std::min(BLOCK - x % BLOCK, n);
+    }
+
+    unsigned int tile(unsigned int x, unsigned int y) const {
+      return (y / TILE) * tilesX + x / TILE;
+    }
+    // makes sure a tile holds its real contents before it is written to
+    void touch(unsigned int t, uint8_t stale, uint8_t written) {
+      uint8_t state = tiles[t].load(std::memory_order_acquire);
+      if ((state & (stale | written)) == written) {
+        // by far the most common case, already cleared and marked
+        return;
+      }
+      if (state & stale) {
+        resolve(t, stale);
+      }
+      tiles[t].fetch_or(written, std::memory_order_relaxed);
+    }
+    void resolve(unsigned int tile, uint8_t stale);
+    void invalidate(uint8_t stale, uint8_t written);
+    void resolveSamples(unsigned int p);
+    // resolves one pixel early, for reads and writes which do not depth test
+    void resolveSamples(glmt::vec2p pos);
+
+  public:
+    // pixels [x, x + w) of rows [y, y + h)
+    struct rect {
+      unsigned int x;
+      unsigned int y;
+      unsigned int w;
+      unsigned int h;
+    };
+
+    unsigned int height;
+    unsigned int width;
+    // maps and packs an HDR colour, for reading pixels back before the caller
+    // has tone mapped the frame, clamps unless the caller knows better
+    uint32_t (*tonemap)(const glm::vec3 &colour);
+    unsigned int samples; // per pixel, 1 unless multisampled
+
+    // where sample i of a pixel sits relative to its centre
+    glm::vec2 offset(unsigned int i) const { return pattern[i]; }
+
+    // unchecked access to row y, the pointers are indexed by at(x) and only
+    // valid for the [x0, x1] run it was made for, which the caller has clipped
+    struct span {
+      uint32_t *colour;
+      depth_format::type *depth;
+      glm::vec3 *hdr;
+      depth_format::type *sample_depth; // null unless multisampled
+      uint32_t *sample_colour;
+      unsigned int samples;
+
+      static unsigned int at(unsigned int x) { return column(x); }
+
+      // depth tests and writes one fragment of the run
+      void set(unsigned int x, float invz, const uint32_t c) const {
+        const depth_format::type d = depth_format::encode(invz);
+        const unsigned int i = at(x);
+        if (depth_format::closer(depth[i], d)) {
+          depth[i] = d;
+          colour[i] = c;
+        }
+      }
+      void set(unsigned int x, float invz, const glm::vec3 &c) const {
+        const depth_format::type d = depth_format::encode(invz);
+        const unsigned int i = at(x);
+        if (depth_format::closer(depth[i], d)) {
+          depth[i] = d;
+          colour[i] = HDR;
+          hdr[i] = c;
+        }
+      }
+      // depth tests and writes the samples of pixel x which are set in mask,
+      // sample i at invz[i] but all of them with the one colour, invz is only
+      // read for the samples in mask
+      void set(unsigned int x, unsigned int mask, const float *invz,
+               const uint32_t c) const {
+        const unsigned int first = at(x) * samples;
+        for (unsigned int i = 0; i < samples; i++) {
+          if (!(mask >> i & 1)) {
+            continue;
+          }
+          const depth_format::type d = depth_format::encode(invz[i]);
+          if (depth_format::closer(sample_depth[first + i], d)) {
+            sample_depth[first + i] = d;
+            sample_colour[first + i] = c;
+          }
+        }
+      }
+    };
+
+    span row(unsigned int y, unsigned int x0, unsigned int x1) {
+      const unsigned int first = tile(x0, y);
+      const unsigned int last = tile(x1, y);
+      for (unsigned int t = first; t <= last; t++) {
+        touch(t, COLOUR_STALE, COLOUR_WRITTEN | COLOUR_CHANGED);
+        touch(t, DEPTH_STALE, DEPTH_WRITTEN);
+        if (samples > 1) {
+          touch(t, SAMPLES_STALE, SAMPLES_WRITTEN);
+        }
+      }
+      const unsigned int offset = rowOffset(y);
+      if (samples == 1) {
+        return span{pixelBuffer + offset, depthBuffer + offset,
+                    hdrBuffer + offset, nullptr, nullptr, 1};
+      }
+      return span{pixelBuffer + offset,
+                  depthBuffer + offset,
+                  hdrBuffer + offset,
+                  sampleDepth + offset * samples,
+                  sampleColour + offset * samples,
+                  samples};
+    }
+
+    // whether the colour tile under (x, y) is still logically clear
+    bool stale(unsigned int x, unsigned int y) const {
+      return tiles[tile(x, y)].load(std::memory_order_acquire) & COLOUR_STALE;
+    }
+
+    // Constructor method
+    framebuffer();
+    // hugepages backs large buffers with 2MB pages where the OS allows it,
+    // samples is 1, 2, 4 or 8
+    framebuffer(int w, int h, bool hugepages = false,
+                unsigned int samples = 1);
+    void destroy();
+    // renders at a lower resolution within the allocated one, clearing it
+    void resize(int w, int h);
+    void setPixelColour(glmt::vec2p pos, const uint32_t colour);
+    void setPixelColour(glmt::vec2p pos, float invz, const uint32_t colour);
+    // shades in HDR, left for the caller to tone map once all is drawn
+    void setPixelColour(glmt::vec2p pos, float invz, const glm::vec3 colour);
+    glmt::rgba8888 getPixelColour(glmt::vec2p pos);
+    float getDepthBuffer(glmt::vec2p pos); // as 1/z whatever the format
+    void clearPixels();
+    void clearDepthBuffer();
+
+    // clears any tiles which are still only logically clear
+    void resolve();
+
+    // averages the samples of each pixel into it, where a sample is not
+    // covered or is behind what was drawn into the pixel itself the pixel
+    // stands in for it, then clears the samples for the next frame
+    void resolveSamples();
+
+    // copies area of the colour buffer to the same place in dst, rows pitch
+    // pixels apart, writing the clear value for stale tiles instead of
+    // resolving them first
+    void copyPixels(uint32_t *dst, unsigned int pitch, rect area) const;
+
+    // the regions whose colour changed since the last call, all of it on the
+    // first, empty if the frame is the same as the last one
+    std::vector<rect> damage();
+    // the same but against what last held at its own last call, for frames
+    // drawn into two framebuffers of the same size in turn
+    std::vector<rect> damage(const framebuffer &last);
+
+    // packed argb8888 laid out as index() says, resolved
+    const uint32_t *pixels() {
+      resolve();
+      return pixelBuffer;
+    }
+  };
+
+} // namespace sdw
@@ -1,19 +1,52 @@
 #pragma once
 #include "glmt.hpp"
+#include "sdw/framebuffer.h"
 
 #include "SDL.h"
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace sdw {
 
+  // copies finished frames out of the framebuffer on its own thread, while
+  // the caller carries on, and draws the next one if it has a second
+  // framebuffer to draw it into. the renderer and texture are only ever used
+  // on the thread which opened the window, as SDL requires
+  struct presenter {
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    // a mostly damaged frame is copied straight into the whole texture,
+    // locked while it is, otherwise the damaged rects are staged in front
+    // and uploaded one locked rect at a time
+    uint32_t *locked; // null unless the whole texture is locked
+    int pitch;        // of locked, in pixels
+    std::vector<uint32_t> front;
+    std::vector<framebuffer::rect> damage;
+    // being copied from, a copy as the caller may swap the one presented for
+    // another while it is
+    framebuffer frame;
+    SDL_Rect source; // how much of front the frame covers, scaled to fit
+    int width;
+    int height;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable signal;
+    bool copying; // the thread is still copying out of frame
+    bool pending; // front holds a frame which has not been presented yet
+    bool quit;
+  };
+
+  // presents a framebuffer in an SDL window
   class window {
 
   private:
     SDL_Window *_window;
-    SDL_Renderer *renderer;
-    SDL_Texture *texture;
-    uint32_t *pixelBuffer;
-    float *depthBuffer;
+    presenter *present; // shared between copies of the window
+    framebuffer *target; // presented but not owned, otherwise buffer is used
+    framebuffer buffer;
 
   public:
     unsigned int height;
@@ -23,10 +56,18 @@ namespace sdw {
     window();
     window(int w, int h, bool fullscreen,
            std::string title = "hybrid software rasteriser");
+    window(framebuffer &target, bool fullscreen,
+           std::string title = "hybrid software rasteriser");
     void close();
     void destroy();
     void renderFrame();
+    // damage as returned by frame().damage(), when the caller needs it too
+    void renderFrame(const std::vector<framebuffer::rect> &damage);
+    // waits for the frame handed to renderFrame to be copied and presents
+    // it, to be called before drawing into its framebuffer again
+    void presentFrame();
     bool pollForInputEvents(SDL_Event *event);
+    framebuffer &frame();
     void setPixelColour(glmt::vec2p pos, const uint32_t colour);
     void setPixelColour(glmt::vec2p pos, float invz, const uint32_t colour);
     glmt::rgba8888 getPixelColour(glmt::vec2p pos);
@@ -34,7 +75,12 @@ namespace sdw {
     void clearPixels();
     void clearDepthBuffer();
 
-    void printMessageAndQuit(const char *message, const char *error);
+    static void printMessageAndQuit(const char *message, const char *error);
+
+  private:
+    void open(bool fullscreen, std::string title);
+    void stop();
+    static void run(presenter *present);
   };
 
 } // namespace sdw
@@ -1,24 +1,32 @@
 #include "sdw/window.h"
 
+#include <cstring>
 #include <iostream>
 
 namespace sdw {
 
   // Simple constructor method
-  window::window() {}
+  window::window() : present(nullptr), target(nullptr) {}
 
   // Complex constructor method
-  window::window(int w, int h, bool fullscreen, std::string title) {
+  window::window(int w, int h, bool fullscreen, std::string title)
+      : present(nullptr), target(nullptr), buffer(w, h) {
+    open(fullscreen, title);
+  }
+
+  // Present a framebuffer owned by the caller
+  window::window(framebuffer &target, bool fullscreen, std::string title)
+      : present(nullptr), target(&target) {
+    open(fullscreen, title);
+  }
+
+  void window::open(bool fullscreen, std::string title) {
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) {
       printMessageAndQuit("Could not initialise SDL: ", SDL_GetError());
     }
 
-    width = w;
-    height = h;
-    pixelBuffer = new uint32_t[width * height];
-    depthBuffer = new float[width * height];
-    clearPixels();
-    clearDepthBuffer();
+    width = frame().width;
+    height = frame().height;
 
     uint32_t flags = SDL_WINDOW_OPENGL;
     if (fullscreen)
@@ -34,7 +42,7 @@ namespace sdw {
     // https://stackoverflow.com/questions/25173495/c-sdl2-get-mouse-coordinates-without-delay
     // flags |= SDL_RENDERER_PRESENTVSYNC;
 
-    renderer = SDL_CreateRenderer(_window, -1, flags);
+    SDL_Renderer *renderer = SDL_CreateRenderer(_window, -1, flags);
     if (renderer == 0)
       printMessageAndQuit("Could not create renderer: ", SDL_GetError());
 
@@ -42,34 +50,150 @@ namespace sdw {
     SDL_RenderSetLogicalSize(renderer, width, height);
 
     int PIXELFORMAT = SDL_PIXELFORMAT_ARGB8888;
-    texture = SDL_CreateTexture(renderer, PIXELFORMAT, SDL_TEXTUREACCESS_STATIC,
-                                width, height);
+    // streaming so damaged regions are written into the texture's own memory,
+    // instead of being copied there again by SDL_UpdateTexture
+    SDL_Texture *texture = SDL_CreateTexture(
+        renderer, PIXELFORMAT, SDL_TEXTUREACCESS_STREAMING, width, height);
     if (texture == 0)
       printMessageAndQuit("Could not allocate texture: ", SDL_GetError());
+
+    present = new presenter();
+    present->renderer = renderer;
+    present->texture = texture;
+    present->locked = nullptr;
+    present->front.resize(width * height);
+    present->width = width;
+    present->height = height;
+    present->copying = false;
+    present->pending = false;
+    present->quit = false;
+    present->thread = std::thread(run, present);
+  }
+
+  // only copies, it never calls SDL
+  void window::run(presenter *present) {
+    std::unique_lock<std::mutex> lock(present->mutex);
+    while (true) {
+      present->signal.wait(lock,
+                           [&] { return present->copying || present->quit; });
+      if (present->quit) {
+        break;
+      }
+      // the window waits for copying to drop before touching front
+      lock.unlock();
+      if (present->locked != nullptr) {
+        // the only copy of the frame, stale tiles are cleared on the way
+        const framebuffer &frame = present->frame;
+        frame.copyPixels(present->locked, present->pitch,
+                         framebuffer::rect{0, 0, frame.width, frame.height});
+      } else {
+        for (const framebuffer::rect &area : present->damage) {
+          present->frame.copyPixels(present->front.data(), present->width,
+                                    area);
+        }
+      }
+      lock.lock();
+      present->copying = false;
+      present->signal.notify_all();
+    }
+  }
+
+  // finishes presenting and joins the copy thread
+  void window::stop() {
+    presentFrame();
+    {
+      std::lock_guard<std::mutex> lock(present->mutex);
+      present->quit = true;
+    }
+    present->signal.notify_all();
+    present->thread.join();
+    SDL_DestroyTexture(present->texture);
+    SDL_DestroyRenderer(present->renderer);
+    delete present;
+    present = nullptr;
   }
 
   // Just close this window without quitting SDL
   void window::close() {
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
+    stop();
     SDL_DestroyWindow(_window);
   }
 
   // Deconstructor method
   void window::destroy() {
-    delete[] pixelBuffer;
-    delete[] depthBuffer;
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
+    stop(); // the copy thread may still be reading the buffer
+    if (target == nullptr) {
+      buffer.destroy();
+    }
     SDL_DestroyWindow(_window);
     SDL_Quit();
   }
 
-  void window::renderFrame() {
-    SDL_UpdateTexture(texture, NULL, pixelBuffer, width * sizeof(uint32_t));
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+  void window::renderFrame() { renderFrame(frame().damage()); }
+
+  // hands the damage over to the copy thread and returns without waiting for
+  // it to be copied, presentFrame finishes the frame, it is presented even
+  // without damage as the window may need redrawing
+  void window::renderFrame(const std::vector<framebuffer::rect> &damage) {
+    presentFrame(); // in case the caller did not
+    // past half of the frame, locking rects and staging them costs more than
+    // copying all of it once
+    unsigned int damaged = 0;
+    for (const framebuffer::rect &area : damage) {
+      damaged += area.w * area.h;
+    }
+    void *pixels = nullptr;
+    int pitch = 0;
+    if (2 * damaged > frame().width * frame().height) {
+      if (SDL_LockTexture(present->texture, NULL, &pixels, &pitch) != 0)
+        printMessageAndQuit("Could not lock texture: ", SDL_GetError());
+    }
+    std::unique_lock<std::mutex> lock(present->mutex);
+    present->locked = static_cast<uint32_t *>(pixels);
+    present->pitch = pitch / sizeof(uint32_t);
+    present->damage = damage;
+    present->frame = frame();
+    // a frame smaller than the window is upscaled into it
+    present->source = {0, 0, int(frame().width), int(frame().height)};
+    present->copying = true;
+    present->pending = true;
+    lock.unlock();
+    present->signal.notify_all();
+  }
+
+  void window::presentFrame() {
+    {
+      std::unique_lock<std::mutex> lock(present->mutex);
+      if (!present->pending) {
+        return;
+      }
+      present->signal.wait(lock, [&] { return !present->copying; });
+      present->pending = false;
+    }
+    if (present->locked != nullptr) {
+      SDL_UnlockTexture(present->texture);
+      present->locked = nullptr;
+    } else {
+      for (const framebuffer::rect &area : present->damage) {
+        // only the locked region is uploaded when it is unlocked
+        const SDL_Rect r = {int(area.x), int(area.y), int(area.w),
+                            int(area.h)};
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(present->texture, &r, &pixels, &pitch) != 0)
+          printMessageAndQuit("Could not lock texture: ", SDL_GetError());
+        for (unsigned int y = 0; y < area.h; y++) {
+          std::memcpy(static_cast<uint8_t *>(pixels) + y * pitch,
+                      &present->front[(area.y + y) * width + area.x],
+                      area.w * sizeof(uint32_t));
+        }
+        SDL_UnlockTexture(present->texture);
+      }
+    }
+    SDL_RenderClear(present->renderer);
+    SDL_RenderCopy(present->renderer, present->texture, &present->source,
+                   NULL);
+    SDL_RenderPresent(present->renderer);
   }
 
   bool window::pollForInputEvents(SDL_Event *event) {
@@ -85,61 +209,28 @@ namespace sdw {
     return false;
   }
 
+  framebuffer &window::frame() { return target ? *target : buffer; }
+
   void window::setPixelColour(glmt::vec2p pos, uint32_t colour) {
-    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
-      // std::cout << x << "," << y << " not on visible screen area" <<
-      // std::endl;
-    } else {
-      pixelBuffer[(pos.y * width) + pos.x] = colour;
-    }
+    frame().setPixelColour(pos, colour);
   }
 
   void window::setPixelColour(glmt::vec2p pos, float invz,
                               const uint32_t colour) {
-    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
-      // std::cout << x << "," << y << " not on visible screen area" <<
-      // std::endl;
-    } else {
-      if (0.0000001f >=
-          depthBuffer[(pos.y * width) + pos.x] - invz) { // threshold
-        depthBuffer[(pos.y * width) + pos.x] = invz;
-        setPixelColour(pos, colour);
-      }
-    }
+    frame().setPixelColour(pos, invz, colour);
   }
 
   glmt::rgba8888 window::getPixelColour(glmt::vec2p pos) {
-    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
-      // std::cout << x << "," << y << " not on visible screen area" <<
-      // std::endl;
-      return glmt::rgba8888::fromargb8888packed(
-          -1); // TODO: return maybe? add semantics to vec2s?
-    } else {
-      return glmt::rgba8888::fromargb8888packed(
-          pixelBuffer[(pos.y * width) + pos.x]);
-    }
+    return frame().getPixelColour(pos);
   }
 
   float window::getDepthBuffer(glmt::vec2p pos) {
-    if ((pos.x < 0) || (pos.x >= width) || (pos.y < 0) || (pos.y >= height)) {
-      return 1;
-    } else {
-      return depthBuffer[(pos.y * width) + pos.x];
-    }
+    return frame().getDepthBuffer(pos);
   }
 
-  void window::clearPixels() {
-    memset(pixelBuffer, 0, width * height * sizeof(uint32_t));
-  }
+  void window::clearPixels() { frame().clearPixels(); }
 
-  void window::clearDepthBuffer() {
-    for (size_t i = 0; i < width * height; i++) {
-      // captures 1/z, instead of z as suggested so
-      // std::numeric_limits<float>::infinity() is not used nothing on screen is
-      // the same as every point being infinity far away 1/inf = 0,
-      depthBuffer[i] = 0;
-    }
-  }
+  void window::clearDepthBuffer() { frame().clearDepthBuffer(); }
 
   void window::printMessageAndQuit(const char *message, const char *error) {
     if (error == NULL) {
@@ -151,4 +242,4 @@ namespace sdw {
     }
   }
 
-} // namespace sdw
\ No newline at end of file
+} // namespace sdw
\ No newline at end of file
@@ -5,6 +5,12 @@
 #include <algorithm>
 #include <vector>
 
+#ifdef __AVX__
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 // strange lerp
 template <typename T>
 std::vector<T> interpolate(T start, T end, std::size_t N) {
@@ -51,7 +57,7 @@ std::vector<glmt::vec2p> naiveline(glmt::vec2<T> start, glmt::vec2<T> end) {
 }
 
 // template <glmt::COLOUR_SPACE CS>
-// void line(sdw::window window, glmt::vec2s start, glmt::vec2s end,
+// void line(sdw::framebuffer window, glmt::vec2s start, glmt::vec2s end,
 //           glmt::colour<CS> colour) {
 //   for (auto const &p : naiveline(start, end)) {
 //     window.setPixelColour(p, colour.argb8888());
@@ -63,7 +69,7 @@ std::vector<glmt::vec2p> naiveline(glmt::vec2<T> start, glmt::vec2<T> end) {
 // xiaolin wu's AA line algorithm
 // translated from wikipedia
 // https://en.wikipedia.org/wiki/Xiaolin_Wu's_line_algorithm
-void line(sdw::window window, glmt::vec2s start, glmt::vec2s end,
+void line(sdw::framebuffer window, glmt::vec2s start, glmt::vec2s end,
           glmt::rgbf01 colour) {
   // To match functions
   auto plot = [&](int x, int y, float c) -> void {
@@ -158,7 +164,7 @@ void line(sdw::window window, glmt::vec2s start, glmt::vec2s end,
 
 template <glmt::COLOUR_SPACE CS>
 void linetriangle(
-    sdw::window window,
+    sdw::framebuffer window,
     std::tuple<std::array<glmt::vec2s, 3>, glmt::colour<CS>> triangle) {
   line(window, std::get<0>(triangle)[0], std::get<0>(triangle)[1],
        std::get<1>(triangle));
@@ -172,24 +178,25 @@ void linetriangle(
 // technically this is iso projection with no rotations if points aren't
 // transformed via proj matrix as an alternative perf increase try Bresenham in
 // 3d https://gist.github.com/yamamushi/5823518
-void line(sdw::window window, glmt::vec3s start, glmt::vec3s end,
+void line(sdw::framebuffer window, glmt::vec3s start, glmt::vec3s end,
           glmt::rgbf01 colour) {
   const float steps =
       glm::ceil(glm::compMax(glm::abs(glm::vec2(end) - glm::vec2(start)))) +
       1.f;
   // Perspective projection preserves lines, but does not preserve distances.
-  start.z = 1.f / start.z;
-  end.z = 1.f / end.z;
+  // 1/w is what is linear along them
+  start.w = 1.f / start.w;
+  end.w = 1.f / end.w;
 
   for (size_t i = 0; i < steps; i++) {
     glmt::vec3s p = glm::mix(glm::vec4(start), glm::vec4(end), i / steps);
-    window.setPixelColour(glmt::vec2p(p), p.z, colour.argb8888());
+    window.setPixelColour(glmt::vec2p(p), p.w, colour.argb8888());
   }
 }
 
 template <glmt::COLOUR_SPACE CS>
 void linetriangle(
-    sdw::window window,
+    sdw::framebuffer window,
     std::tuple<std::array<glmt::vec3s, 3>, glmt::colour<CS>> triangle) {
   line(window, std::get<0>(triangle)[0], std::get<0>(triangle)[1],
        std::get<1>(triangle));
@@ -202,7 +209,7 @@ void linetriangle(
 #include <glm/gtc/random.hpp>
 
 std::tuple<std::array<glmt::vec2s, 3>, glmt::rgb888>
-randomtriangleinside(sdw::window window) {
+randomtriangleinside(sdw::framebuffer window) {
   glmt::rgb888 colour(glm::linearRand(0, 255), glm::linearRand(0, 255),
                       glm::linearRand(0, 255));
   std::array<glmt::vec2s, 3> points{
@@ -219,7 +226,7 @@ randomtriangleinside(sdw::window window) {
 #include <algorithm>
 
 template <glmt::COLOUR_SPACE CS>
-void filledtriangleflat(sdw::window window, glmt::vec2s top,
+void filledtriangleflat(sdw::framebuffer window, glmt::vec2s top,
                         glmt::vec2s bottom1, glmt::vec2s bottom2,
                         glmt::colour<CS> colour) {
   // assumes bottom1.y == bottom2.y
@@ -241,7 +248,7 @@ void filledtriangleflat(sdw::window window, glmt::vec2s top,
 // http://www.sunshine2k.de/coding/java/TriangleRasterization/TriangleRasterization.html
 // template <glmt::COLOUR_SPACE CS>
 // void filledtriangle(
-//     sdw::window window,
+//     sdw::framebuffer window,
 //     std::tuple<std::array<glmt::vec2s, 3>, glmt::colour<CS>> triangle) {
 //   std::sort(std::begin(std::get<0>(triangle)),
 //   std::end(std::get<0>(triangle)),
@@ -281,7 +288,7 @@ glm::vec3 barycentric(glmt::vec2<T> p, std::array<glmt::vec2<T>, 3> t) {
 
 template <glmt::COLOUR_SPACE CS>
 void filledtriangle(
-    sdw::window window,
+    sdw::framebuffer window,
     std::tuple<std::array<glmt::vec2s, 3>, glmt::colour<CS>> triangle) {
   glmt::bound2s bounds(std::get<0>(triangle).begin(),
                        std::get<0>(triangle).end());
@@ -305,7 +312,7 @@ void filledtriangle(
   }
 }
 
-void texturedtriangle(sdw::window window, std::array<glmt::vec2s, 3> tri,
+void texturedtriangle(sdw::framebuffer window, std::array<glmt::vec2s, 3> tri,
                       std::array<glmt::vec2t, 3> tex, glmt::PPM &ppm) {
   glmt::bound2s bounds(tri.begin(), tri.end());
   // TODO: glmt::bound2::operator+ // largest bound which fits both
@@ -401,94 +408,999 @@ sdw::window texture_window(std::string filename, std::string title = "") {
   return texture_window; // caller needs to call .close()
 }
 
-template <glmt::COLOUR_SPACE CS>
-void filledtriangle(
-    sdw::window window,
-    std::tuple<std::array<glmt::vec3s, 3>, glmt::colour<CS>> triangle) {
+inline uint32_t pack(const sdw::framebuffer &, uint32_t colour) {
+  return colour;
+}
+inline uint32_t pack(const sdw::framebuffer &window, const glm::vec3 &colour) {
+  return window.tonemap(colour);
+}
 
-  std::array<glmt::vec2s, 3> s_tri{glm::vec2(std::get<0>(triangle)[0]),
-                                   glm::vec2(std::get<0>(triangle)[1]),
-                                   glm::vec2(std::get<0>(triangle)[2])};
+// depth tests and writes the colour shade(bc, zinv) returns for each pixel of
+// a screen space triangle, given its barycentric coordinates and 1/z of its
+// depth in view space, which the vertices carry as w
+//
+// a multisampled window is still shaded once for each pixel, at its centre or
+// at a sample if the centre is outside, and that colour is written to each
+// sample the triangle covers at the depth of that sample
+template <typename F>
+void rasterise(sdw::framebuffer window, const std::array<glmt::vec3s, 3> &ss,
+               F shade) {
+  std::array<glmt::vec2s, 3> s_tri{glm::vec2(ss[0]), glm::vec2(ss[1]),
+                                   glm::vec2(ss[2])};
   glmt::bound2s bounds(s_tri.begin(), s_tri.end());
 
   bounds.min.x = glm::max(glm::floor(bounds.min.x), 0.f);
   bounds.min.y = glm::max(glm::floor(bounds.min.y), 0.f);
-  bounds.max.x = glm::min(glm::ceil(bounds.max.x), (float)window.width);
-  bounds.max.y = glm::min(glm::ceil(bounds.max.y), (float)window.height);
+  bounds.max.x = glm::min(glm::ceil(bounds.max.x), window.width - 1.f);
+  bounds.max.y = glm::min(glm::ceil(bounds.max.y), window.height - 1.f);
+  if (bounds.max.x < bounds.min.x) {
+    return; // off screen
+  }
+
+  // once per triangle rather than once per pixel
+  const glm::mat3 toBarycentric =
+      barycentric(std::array<glm::vec2, 3>{s_tri[0], s_tri[1], s_tri[2]});
+  const auto zinv = [&](const glm::vec3 &bc) {
+    return bc[0] / ss[0].w + bc[1] / ss[1].w + bc[2] / ss[2].w;
+  };
+
+  if (window.samples == 1) {
+    for (int y = bounds.min.y; y <= bounds.max.y; y++) {
+      const sdw::framebuffer::span row =
+          window.row(y, bounds.min.x, bounds.max.x);
+      for (int x = bounds.min.x; x <= bounds.max.x; x++) {
+        glm::vec3 bc = toBarycentric * glm::vec3(x, y, 1);
+        if (bc[0] <= 0 || bc[1] <= 0 || bc[2] <= 0) {
+          // outside of triangle
+          continue;
+        }
+        row.set(x, zinv(bc), shade(bc, zinv(bc)));
+      }
+    }
+    return;
+  }
+
+  // barycentric coordinates are linear in screen space, so each sample is a
+  // constant step away from the centre
+  std::array<glm::vec3, 8> steps;
+  for (unsigned int i = 0; i < window.samples; i++) {
+    steps[i] = toBarycentric * glm::vec3(window.offset(i), 0);
+  }
 
   for (int y = bounds.min.y; y <= bounds.max.y; y++) {
+    const sdw::framebuffer::span row =
+        window.row(y, bounds.min.x, bounds.max.x);
     for (int x = bounds.min.x; x <= bounds.max.x; x++) {
-      glm::vec3 bc = barycentric(glmt::vec2s(x, y), s_tri);
-      if (bc[0] <= 0 || bc[1] <= 0 || bc[2] <= 0) {
+      const glm::vec3 centre = toBarycentric * glm::vec3(x, y, 1);
+      glm::vec3 bc = centre;
+      const bool inside = bc[0] > 0 && bc[1] > 0 && bc[2] > 0;
+
+      unsigned int mask = 0;
+      float invz[8] = {};
+      for (unsigned int i = 0; i < window.samples; i++) {
+        const glm::vec3 sample = centre + steps[i];
+        if (sample[0] <= 0 || sample[1] <= 0 || sample[2] <= 0) {
+          continue;
+        }
+        if (!inside && !mask) {
+          bc = sample; // never extrapolate past the edge
+        }
+        mask |= 1u << i;
+        invz[i] = zinv(sample);
+      }
+      if (!mask) {
         // outside of triangle
         continue;
       }
-
-      float zinv = bc[0] / std::get<0>(triangle)[0].z +
-                   bc[1] / std::get<0>(triangle)[1].z +
-                   bc[2] / std::get<0>(triangle)[2].z;
-      window.setPixelColour(glmt::vec2p(x, y), zinv,
-                            std::get<1>(triangle).argb8888());
+      row.set(x, mask, invz, pack(window, shade(bc, zinv(bc))));
     }
   }
 }
 
+template <glmt::COLOUR_SPACE CS>
+void filledtriangle(
+    sdw::framebuffer window,
+    std::tuple<std::array<glmt::vec3s, 3>, glmt::colour<CS>> triangle) {
+  const uint32_t colour = std::get<1>(triangle).argb8888();
+  rasterise(window, std::get<0>(triangle),
+            [&](const glm::vec3 &, float) { return colour; });
+}
+
 struct Intersection {
   glmt::vec3w position;
   float distance;
   int triangleIndex;
 };
 
+// Möller–Trumbore, solves start + t * dir = v0 + u * e1 + v * e2 by Cramer's
+// rule rather than inverting the matrix, edges included
+inline bool intersect(const glm::vec3 &start, const glm::vec3 &dir,
+                      const glm::vec3 &v0, const glm::vec3 &e1,
+                      const glm::vec3 &e2, float &t) {
+  const glm::vec3 p = glm::cross(dir, e2);
+  const float det = glm::dot(e1, p);
+  if (det == 0) {
+    return false; // parallel
+  }
+  const float inv = 1 / det;
+  const glm::vec3 s = start - v0;
+  const float u = glm::dot(s, p) * inv;
+  const glm::vec3 q = glm::cross(s, e1);
+  const float v = glm::dot(dir, q) * inv;
+  t = glm::dot(e2, q) * inv;
+  // in front of the start, along e1, along e2 and inside e3
+  return 0 <= t && 0 <= u && 0 <= v && u + v <= 1;
+}
+
 bool intersect(glm::vec4 start, glm::vec4 dir,
                const std::array<glm::vec4, 3> &triangle,
                Intersection &intersection) {
-
-  glm::vec4 v0 = triangle[0];
-  glm::vec4 v1 = triangle[1];
-  glm::vec4 v2 = triangle[2];
-
-  glm::vec3 e1 = glm::vec3(v1 - v0);
-  glm::vec3 e2 = glm::vec3(v2 - v0);
-  glm::vec3 b = glm::vec3(start - v0);
-  glm::mat3 A(-glm::vec3(dir), e1, e2);
-  glm::vec3 x = glm::inverse(A) * b;
-
-  if (0 <= x[0] &&
-      // in front of camera
-      0 <= x[1] &&
-      // along e1 /*x[1] <= 1 &&*/
-      0 <= x[2] &&
-      // along e2 /*x[2] <= 1 &&*/
-      (x[1] + x[2] <= 1)
-      // inside "e3"
-  ) {
-    intersection.position = start + x[0] * dir;
-    intersection.distance = x[0];
+  const glm::vec3 v0(triangle[0]);
+  float t;
+  if (intersect(glm::vec3(start), glm::vec3(dir), v0,
+                glm::vec3(triangle[1]) - v0, glm::vec3(triangle[2]) - v0, t)) {
+    intersection.position = start + t * dir;
+    intersection.distance = t;
     return true;
   }
 
   return false;
 }
 
-bool ClosestIntersection(glm::vec4 start, glm::vec4 dir,
-                         const std::vector<std::array<glm::vec4, 3>> &triangles,
+// the first vertex and both edges of each triangle, computed once rather than
+// per ray, a component per array so a run of them is contiguous
+struct TriangleRecords {
+  std::vector<float> v0[3];
+  std::vector<float> e1[3];
+  std::vector<float> e2[3];
+
+  void push_back(const std::array<glm::vec4, 3> &triangle) {
+    for (int a = 0; a < 3; a++) {
+      v0[a].push_back(triangle[0][a]);
+      e1[a].push_back(triangle[1][a] - triangle[0][a]);
+      e2[a].push_back(triangle[2][a] - triangle[0][a]);
+    }
+  }
+
+  size_t size() const { return v0[0].size(); }
+
+  bool intersect(size_t i, const glm::vec3 &start, const glm::vec3 &dir,
+                 float &t) const {
+    return ::intersect(start, dir, glm::vec3(v0[0][i], v0[1][i], v0[2][i]),
+                       glm::vec3(e1[0][i], e1[1][i], e1[2][i]),
+                       glm::vec3(e2[0][i], e2[1][i], e2[2][i]), t);
+  }
+};
+
+// bounding volume hierarchy over triangles, split where the surface area
+// heuristic says a ray is least likely to have to look at both halves
+struct BVH {
+  struct Node {
+    glm::vec3 min;
+    glm::vec3 max;
+    // a leaf's triangles are order[first, first + count), an inner node has a
+    // count of 0 and its children at the next index and at first
+    unsigned int first;
+    unsigned int count;
+
+    // how far along the ray it enters the box, -1 if it misses it
+    float enter(const glm::vec3 &origin, const glm::vec3 &inv) const {
+      const glm::vec3 t0 = (min - origin) * inv;
+      const glm::vec3 t1 = (max - origin) * inv;
+      const float entry = glm::max(glm::compMax(glm::min(t0, t1)), 0.f);
+      const float exit = glm::compMin(glm::max(t0, t1));
+      return entry <= exit ? entry : -1;
+    }
+  };
+
+  static const unsigned int BINS = 12;  // candidate splits per axis
+  static const unsigned int LEAF = 4;   // triangles a leaf may always hold
+  static const unsigned int DEPTH = 64; // deeper nodes are left as leaves
+
+  std::vector<Node> nodes; // the root first, then depth first
+  std::vector<unsigned int> order; // triangle indices
+  TriangleRecords records; // in the same order, so leaves are runs of them
+
+  BVH() {}
+  explicit BVH(const std::vector<std::array<glm::vec4, 3>> &triangles) {
+    if (triangles.empty()) {
+      return;
+    }
+    std::vector<glm::vec3> mins(triangles.size());
+    std::vector<glm::vec3> maxs(triangles.size());
+    std::vector<glm::vec3> centres(triangles.size());
+    order.resize(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+      const std::array<glm::vec4, 3> &t = triangles[i];
+      mins[i] = glm::min(glm::vec3(t[0]), glm::min(glm::vec3(t[1]),
+                                                   glm::vec3(t[2])));
+      maxs[i] = glm::max(glm::vec3(t[0]), glm::max(glm::vec3(t[1]),
+                                                   glm::vec3(t[2])));
+      centres[i] = (mins[i] + maxs[i]) / 2.f;
+      order[i] = i;
+    }
+    nodes.reserve(2 * triangles.size());
+    nodes.push_back(Node());
+    split(0, 0, triangles.size(), 0, mins, maxs, centres);
+    for (const unsigned int t : order) {
+      records.push_back(triangles[t]);
+    }
+  }
+
+  static float area(const glm::vec3 &min, const glm::vec3 &max) {
+    const glm::vec3 d = glm::max(max - min, 0.f);
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+  }
+
+private:
+  void split(unsigned int n, unsigned int first, unsigned int count,
+             unsigned int depth, const std::vector<glm::vec3> &mins,
+             const std::vector<glm::vec3> &maxs,
+             const std::vector<glm::vec3> &centres) {
+    glm::vec3 min(std::numeric_limits<float>::max());
+    glm::vec3 max(std::numeric_limits<float>::lowest());
+    glm::vec3 cmin = min;
+    glm::vec3 cmax = max;
+    for (unsigned int i = first; i < first + count; i++) {
+      min = glm::min(min, mins[order[i]]);
+      max = glm::max(max, maxs[order[i]]);
+      cmin = glm::min(cmin, centres[order[i]]);
+      cmax = glm::max(cmax, centres[order[i]]);
+    }
+    // a little slack, the ray test can land just outside of a triangle
+    nodes[n].min = min - 1e-4f;
+    nodes[n].max = max + 1e-4f;
+    nodes[n].first = first;
+    nodes[n].count = count;
+    if (count <= 1 || depth + 1 >= DEPTH) {
+      return;
+    }
+
+    // binned by centre, costs relative to testing one triangle
+    int axis = -1;
+    unsigned int bin = 0;
+    float best = count;
+    for (int a = 0; a < 3; a++) {
+      const float extent = cmax[a] - cmin[a];
+      if (extent <= 0) {
+        continue;
+      }
+      unsigned int counts[BINS] = {};
+      glm::vec3 bmin[BINS];
+      glm::vec3 bmax[BINS];
+      std::fill_n(bmin, BINS, glm::vec3(std::numeric_limits<float>::max()));
+      std::fill_n(bmax, BINS, glm::vec3(std::numeric_limits<float>::lowest()));
+      for (unsigned int i = first; i < first + count; i++) {
+        const unsigned int t = order[i];
+        const unsigned int b = glm::min<unsigned int>(
+            (centres[t][a] - cmin[a]) / extent * BINS, BINS - 1);
+        counts[b]++;
+        bmin[b] = glm::min(bmin[b], mins[t]);
+        bmax[b] = glm::max(bmax[b], maxs[t]);
+      }
+
+      // sweep from the right, then from the left pricing each split
+      float right[BINS];
+      glm::vec3 lo(std::numeric_limits<float>::max());
+      glm::vec3 hi(std::numeric_limits<float>::lowest());
+      unsigned int below = 0;
+      for (unsigned int b = BINS - 1; b > 0; b--) {
+        lo = glm::min(lo, bmin[b]);
+        hi = glm::max(hi, bmax[b]);
+        below += counts[b];
+        right[b] = below * area(lo, hi);
+      }
+      lo = glm::vec3(std::numeric_limits<float>::max());
+      hi = glm::vec3(std::numeric_limits<float>::lowest());
+      below = 0;
+      for (unsigned int b = 0; b < BINS - 1; b++) {
+        lo = glm::min(lo, bmin[b]);
+        hi = glm::max(hi, bmax[b]);
+        below += counts[b];
+        const float cost = 1 + (below * area(lo, hi) + right[b + 1]) /
+                                   area(min, max);
+        if (below > 0 && below < count && cost < best) {
+          best = cost;
+          axis = a;
+          bin = b;
+        }
+      }
+    }
+    if (axis == -1 && count <= LEAF) {
+      return; // cheaper to test them all
+    }
+    if (axis == -1) {
+      // no split pays off but the leaf would be too big, halve it by centre
+      axis = 0;
+      for (int a = 1; a < 3; a++) {
+        axis = cmax[a] - cmin[a] > cmax[axis] - cmin[axis] ? a : axis;
+      }
+      bin = BINS / 2 - 1;
+    }
+
+    const float extent = cmax[axis] - cmin[axis];
+    unsigned int *middle = std::partition(
+        &order[first], &order[first] + count, [&](unsigned int t) {
+          return glm::min<unsigned int>(
+                     (centres[t][axis] - cmin[axis]) / extent * BINS,
+                     BINS - 1) <= bin;
+        });
+    const unsigned int left = middle - &order[first];
+    if (left == 0 || left == count) {
+      return; // every centre is the same
+    }
+
+    nodes[n].count = 0;
+    nodes.push_back(Node());
+    split(n + 1, first, left, depth + 1, mins, maxs, centres);
+    const unsigned int second = nodes.size();
+    nodes[n].first = second;
+    nodes.push_back(Node());
+    split(second, first + left, count - left, depth + 1, mins, maxs,
+          centres);
+  }
+};
+
+// closest hit, walking the nearer child first so the farther is mostly culled,
+// ties go to the lowest triangle index as they would testing them in order
+bool ClosestIntersection(glm::vec4 start, glm::vec4 dir, const BVH &bvh,
                          Intersection &closestIntersection) {
-  closestIntersection.distance = std::numeric_limits<float>::infinity();
+  closestIntersection.distance = std::numeric_limits<float>::max();
+  closestIntersection.triangleIndex = -1;
+  if (bvh.nodes.empty()) {
+    return false;
+  }
 
-  for (size_t i = 0; i < triangles.size(); i++) {
-    Intersection temp;
-    bool triangleIntersects = intersect(start, dir, triangles[i], temp);
+  const glm::vec3 origin(start);
+  glm::vec3 inv;
+  for (int a = 0; a < 3; a++) {
+    // the slab test can't take an infinity under -ffinite-math-only
+    inv[a] = 1 / (glm::abs(dir[a]) > 1e-12f ? dir[a] : 1e-12f);
+  }
 
-    if (triangleIntersects) {
-      if (temp.distance < closestIntersection.distance) {
-        closestIntersection.distance = temp.distance;
-        closestIntersection.position = temp.position;
-        closestIntersection.triangleIndex = i;
+  // nodes still to visit and where the ray enters them
+  std::pair<unsigned int, float> stack[BVH::DEPTH];
+  unsigned int size = 0;
+  stack[size++] = std::make_pair(0u, bvh.nodes[0].enter(origin, inv));
+  while (size > 0) {
+    const std::pair<unsigned int, float> top = stack[--size];
+    if (top.second < 0 || top.second > closestIntersection.distance) {
+      continue; // missed, or a closer hit was found since it was pushed
+    }
+
+    const BVH::Node &node = bvh.nodes[top.first];
+    if (node.count > 0) {
+      for (unsigned int i = node.first; i < node.first + node.count; i++) {
+        const int index = bvh.order[i];
+        float t;
+        if (bvh.records.intersect(i, origin, glm::vec3(dir), t) &&
+            (t < closestIntersection.distance ||
+             (t == closestIntersection.distance &&
+              index < closestIntersection.triangleIndex))) {
+          closestIntersection.distance = t;
+          closestIntersection.position = start + t * dir;
+          closestIntersection.triangleIndex = index;
+        }
       }
+      continue;
+    }
+
+    std::pair<unsigned int, float> a(top.first + 1, 0);
+    std::pair<unsigned int, float> b(node.first, 0);
+    a.second = bvh.nodes[a.first].enter(origin, inv);
+    b.second = bvh.nodes[b.first].enter(origin, inv);
+    if (b.second >= 0 && (a.second < 0 || b.second < a.second)) {
+      std::swap(a, b);
     }
+    // the nearer on top
+    stack[size++] = b;
+    stack[size++] = a;
   }
 
-  return closestIntersection.distance < std::numeric_limits<float>::infinity();
+  return closestIntersection.triangleIndex != -1;
+}
+
+// rays traced through the BVH together, as wide as the vector unit so that
+// each step is one instruction across every lane
+#ifdef __AVX__
+const unsigned int PACKET = 8;
+#else
+const unsigned int PACKET = 4;
+#endif
+
+#ifdef __SSE__
+// the few operations the packet tests need, a float per lane
+namespace lanes {
+#ifdef __AVX__
+typedef __m256 type;
+inline type load(const float *p) { return _mm256_loadu_ps(p); }
+inline void store(float *p, type a) { _mm256_storeu_ps(p, a); }
+inline type splat(float f) { return _mm256_set1_ps(f); }
+inline type add(type a, type b) { return _mm256_add_ps(a, b); }
+inline type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+inline type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+inline type div(type a, type b) { return _mm256_div_ps(a, b); }
+inline type min(type a, type b) { return _mm256_min_ps(a, b); }
+inline type max(type a, type b) { return _mm256_max_ps(a, b); }
+inline type le(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline type ne(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+inline type both(type a, type b) { return _mm256_and_ps(a, b); }
+// b where mask is set, otherwise a
+inline type select(type a, type b, type mask) {
+  return _mm256_blendv_ps(a, b, mask);
+}
+inline int bits(type mask) { return _mm256_movemask_ps(mask); }
+#else
+typedef __m128 type;
+inline type load(const float *p) { return _mm_loadu_ps(p); }
+inline void store(float *p, type a) { _mm_storeu_ps(p, a); }
+inline type splat(float f) { return _mm_set1_ps(f); }
+inline type add(type a, type b) { return _mm_add_ps(a, b); }
+inline type sub(type a, type b) { return _mm_sub_ps(a, b); }
+inline type mul(type a, type b) { return _mm_mul_ps(a, b); }
+inline type div(type a, type b) { return _mm_div_ps(a, b); }
+inline type min(type a, type b) { return _mm_min_ps(a, b); }
+inline type max(type a, type b) { return _mm_max_ps(a, b); }
+inline type le(type a, type b) { return _mm_cmple_ps(a, b); }
+inline type ne(type a, type b) { return _mm_cmpneq_ps(a, b); }
+inline type both(type a, type b) { return _mm_and_ps(a, b); }
+inline type select(type a, type b, type mask) {
+  return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b));
+}
+inline int bits(type mask) { return _mm_movemask_ps(mask); }
+#endif
+} // namespace lanes
+#endif
+
+// a component per array, unused lanes repeat a used one rather than being
+// masked out
+struct Packet {
+  float origin[3][PACKET];
+  float dir[3][PACKET];
+  float inv[3][PACKET];   // 1 / dir, kept finite for the slab test
+  float distance[PACKET]; // how far along each lane is still searched
+
+  void set(unsigned int lane, const glm::vec3 &o, const glm::vec3 &d) {
+    for (int a = 0; a < 3; a++) {
+      origin[a][lane] = o[a];
+      dir[a][lane] = d[a];
+      inv[a][lane] = 1 / (glm::abs(d[a]) > 1e-12f ? d[a] : 1e-12f);
+    }
+  }
+
+  // the lanes only take the same path through the BVH if their directions
+  // share signs
+  bool coherent() const {
+    for (int a = 0; a < 3; a++) {
+      for (unsigned int l = 1; l < PACKET; l++) {
+        if ((dir[a][l] < 0) != (dir[a][0] < 0)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // whether any lane enters the box before its distance
+  bool enters(const BVH::Node &node) const {
+#ifdef __SSE__
+    using namespace lanes;
+    type entry = splat(0);
+    type exit = load(distance);
+    for (int a = 0; a < 3; a++) {
+      const type o = load(origin[a]);
+      const type i = load(inv[a]);
+      const type t0 = mul(sub(splat(node.min[a]), o), i);
+      const type t1 = mul(sub(splat(node.max[a]), o), i);
+      entry = max(entry, min(t0, t1));
+      exit = min(exit, max(t0, t1));
+    }
+    return bits(le(entry, exit)) != 0;
+#else
+    int entered = 0;
+    for (unsigned int l = 0; l < PACKET; l++) {
+      const float x0 = (node.min.x - origin[0][l]) * inv[0][l];
+      const float x1 = (node.max.x - origin[0][l]) * inv[0][l];
+      const float y0 = (node.min.y - origin[1][l]) * inv[1][l];
+      const float y1 = (node.max.y - origin[1][l]) * inv[1][l];
+      const float z0 = (node.min.z - origin[2][l]) * inv[2][l];
+      const float z1 = (node.max.z - origin[2][l]) * inv[2][l];
+      const float entry =
+          glm::max(glm::max(glm::min(x0, x1), glm::min(y0, y1)),
+                   glm::max(glm::min(z0, z1), 0.f));
+      const float exit = glm::min(glm::min(glm::max(x0, x1), glm::max(y0, y1)),
+                                  glm::max(z0, z1));
+      entered |= entry <= exit && entry <= distance[l];
+    }
+    return entered;
+#endif
+  }
+
+  // Moller-Trumbore against record i in every lane at once, hit is 1 where t
+  // is on the triangle and in front, whatever the distance
+  void intersect(const TriangleRecords &records, size_t i,
+                 float (&t)[PACKET], int (&hit)[PACKET]) const {
+    const float v0[3] = {records.v0[0][i], records.v0[1][i], records.v0[2][i]};
+    const float e1[3] = {records.e1[0][i], records.e1[1][i], records.e1[2][i]};
+    const float e2[3] = {records.e2[0][i], records.e2[1][i], records.e2[2][i]};
+#ifdef __SSE__
+    using namespace lanes;
+    const type dx = load(dir[0]), dy = load(dir[1]), dz = load(dir[2]);
+    const type e1x = splat(e1[0]), e1y = splat(e1[1]), e1z = splat(e1[2]);
+    const type e2x = splat(e2[0]), e2y = splat(e2[1]), e2z = splat(e2[2]);
+    const type px = sub(mul(dy, e2z), mul(dz, e2y));
+    const type py = sub(mul(dz, e2x), mul(dx, e2z));
+    const type pz = sub(mul(dx, e2y), mul(dy, e2x));
+    const type det = add(add(mul(e1x, px), mul(e1y, py)), mul(e1z, pz));
+    const type zero = splat(0);
+    const type one = splat(1);
+    const type valid = ne(det, zero);
+    const type rdet = div(one, select(one, det, valid));
+    const type sx = sub(load(origin[0]), splat(v0[0]));
+    const type sy = sub(load(origin[1]), splat(v0[1]));
+    const type sz = sub(load(origin[2]), splat(v0[2]));
+    const type u =
+        mul(add(add(mul(sx, px), mul(sy, py)), mul(sz, pz)), rdet);
+    const type qx = sub(mul(sy, e1z), mul(sz, e1y));
+    const type qy = sub(mul(sz, e1x), mul(sx, e1z));
+    const type qz = sub(mul(sx, e1y), mul(sy, e1x));
+    const type v =
+        mul(add(add(mul(dx, qx), mul(dy, qy)), mul(dz, qz)), rdet);
+    const type d =
+        mul(add(add(mul(e2x, qx), mul(e2y, qy)), mul(e2z, qz)), rdet);
+    const type inside =
+        both(both(le(zero, u), le(zero, v)), le(add(u, v), one));
+    const int mask = bits(both(both(valid, le(zero, d)), inside));
+    store(t, d);
+    for (unsigned int l = 0; l < PACKET; l++) {
+      hit[l] = mask >> l & 1;
+    }
+#else
+    for (unsigned int l = 0; l < PACKET; l++) {
+      const float px = dir[1][l] * e2[2] - dir[2][l] * e2[1];
+      const float py = dir[2][l] * e2[0] - dir[0][l] * e2[2];
+      const float pz = dir[0][l] * e2[1] - dir[1][l] * e2[0];
+      const float det = e1[0] * px + e1[1] * py + e1[2] * pz;
+      const float rdet = 1 / (det != 0 ? det : 1);
+      const float sx = origin[0][l] - v0[0];
+      const float sy = origin[1][l] - v0[1];
+      const float sz = origin[2][l] - v0[2];
+      const float u = (sx * px + sy * py + sz * pz) * rdet;
+      const float qx = sy * e1[2] - sz * e1[1];
+      const float qy = sz * e1[0] - sx * e1[2];
+      const float qz = sx * e1[1] - sy * e1[0];
+      const float v =
+          (dir[0][l] * qx + dir[1][l] * qy + dir[2][l] * qz) * rdet;
+      t[l] = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * rdet;
+      hit[l] = det != 0 && 0 <= t[l] && 0 <= u && 0 <= v && u + v <= 1;
+    }
+#endif
+  }
+
+  glm::vec4 start(unsigned int l) const {
+    return glm::vec4(origin[0][l], origin[1][l], origin[2][l], 1);
+  }
+  glm::vec4 direction(unsigned int l) const {
+    return glm::vec4(dir[0][l], dir[1][l], dir[2][l], 0);
+  }
+};
+
+// whether anything is hit in [0, tmax) along the ray, for shadows, which can
+// stop at the first hit rather than look for the closest
+bool occluded(glm::vec4 start, glm::vec4 dir, float tmax, const BVH &bvh) {
+  if (bvh.nodes.empty()) {
+    return false;
+  }
+  const glm::vec3 origin(start);
+  glm::vec3 inv;
+  for (int a = 0; a < 3; a++) {
+    inv[a] = 1 / (glm::abs(dir[a]) > 1e-12f ? dir[a] : 1e-12f);
+  }
+
+  unsigned int stack[BVH::DEPTH];
+  unsigned int size = 0;
+  stack[size++] = 0;
+  while (size > 0) {
+    const unsigned int n = stack[--size];
+    const BVH::Node &node = bvh.nodes[n];
+    const float entry = node.enter(origin, inv);
+    if (entry < 0 || entry >= tmax) {
+      continue;
+    }
+    if (node.count == 0) {
+      stack[size++] = node.first;
+      stack[size++] = n + 1;
+      continue;
+    }
+    for (unsigned int i = node.first; i < node.first + node.count; i++) {
+      float t;
+      if (bvh.records.intersect(i, origin, glm::vec3(dir), t) && t < tmax) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// occluded() for a packet, each lane searching up to its distance, which is
+// made negative if something is in the way
+void occluded(Packet &packet, const BVH &bvh) {
+  float *distance = packet.distance;
+  if (!packet.coherent() || bvh.nodes.empty()) {
+    for (unsigned int l = 0; l < PACKET; l++) {
+      if (occluded(packet.start(l), packet.direction(l), distance[l], bvh)) {
+        distance[l] = -1;
+      }
+    }
+    return;
+  }
+
+  unsigned int stack[BVH::DEPTH];
+  unsigned int size = 0;
+  stack[size++] = 0;
+  while (size > 0) {
+    const unsigned int n = stack[--size];
+    const BVH::Node &node = bvh.nodes[n];
+    if (!packet.enters(node)) {
+      continue;
+    }
+    if (node.count == 0) {
+      stack[size++] = node.first;
+      stack[size++] = n + 1;
+      continue;
+    }
+
+    for (unsigned int i = node.first; i < node.first + node.count; i++) {
+      float t[PACKET];
+      int hit[PACKET];
+      packet.intersect(bvh.records, i, t, hit);
+      // a blocked lane stays out of every box from then on
+      int open = 0;
+      for (unsigned int l = 0; l < PACKET; l++) {
+        distance[l] = hit[l] && t[l] < distance[l] ? -1 : distance[l];
+        open |= distance[l] >= 0;
+      }
+      if (!open) {
+        return;
+      }
+    }
+  }
+}
+
+// a pixel which a primary ray needs to be fired through, triangleIndex is the
+// closest triangle found by rasterising or -1 if the raster could not tell
+struct Fragment {
+  glmt::vec2p pos;
+  int triangleIndex;
+};
+
+// cheap raster pre-pass for ray tracing, so that only pixels which are covered
+// by a triangle get a primary ray. bounds are inclusive
+std::vector<Fragment>
+coverage(const std::vector<std::array<glm::vec4, 3>> &triangles, // camera space
+         const std::vector<std::array<glmt::vec3s, 3>> &projected,
+         glmt::bound2s bounds) {
+  const int min_x = bounds.min.x;
+  const int min_y = bounds.min.y;
+  const int w = glm::max(static_cast<int>(bounds.max.x) - min_x + 1, 0);
+  const int h = glm::max(static_cast<int>(bounds.max.y) - min_y + 1, 0);
+
+  std::vector<Fragment> fragments;
+
+  // projecting a vertex behind the near plane flips it, so the raster can't be
+  // trusted and every pixel in bounds has to be traced
+  bool behind = false;
+  for (const auto &triangle : triangles) {
+    for (const glm::vec4 &v : triangle) {
+      behind |= v.z > -0.1f;
+    }
+  }
+  if (behind) {
+    fragments.reserve(w * h);
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        fragments.push_back({glmt::vec2p(min_x + x, min_y + y), -1});
+      }
+    }
+    return fragments;
+  }
+
+  std::vector<int> ids(w * h, -1); // -2 for covered but ambiguous
+  std::vector<float> depth(w * h, std::numeric_limits<float>::max());
+
+  for (size_t i = 0; i < projected.size(); i++) {
+    const std::array<glmt::vec3s, 3> &ss = projected[i];
+    std::array<glm::vec2, 3> s_tri{glm::vec2(ss[0]), glm::vec2(ss[1]),
+                                   glm::vec2(ss[2])};
+
+    // barycentric() is too imprecise to order nearly touching triangles, so
+    // work relative to the first vertex instead
+    const glm::vec2 e1 = s_tri[1] - s_tri[0];
+    const glm::vec2 e2 = s_tri[2] - s_tri[0];
+    const float area = e1.x * e2.y - e2.x * e1.y;
+    if (glm::abs(area) < 1e-6f) {
+      // degenerate, the ray can't hit it either
+      continue;
+    }
+    const float dz1 = ss[1].z - ss[0].z;
+    const float dz2 = ss[2].z - ss[0].z;
+
+    glm::vec2 lo = glm::min(s_tri[0], glm::min(s_tri[1], s_tri[2]));
+    glm::vec2 hi = glm::max(s_tri[0], glm::max(s_tri[1], s_tri[2]));
+    const int x0 = glm::max(static_cast<int>(glm::floor(lo.x)), min_x);
+    const int y0 = glm::max(static_cast<int>(glm::floor(lo.y)), min_y);
+    const int x1 = glm::min(static_cast<int>(glm::ceil(hi.x)), min_x + w - 1);
+    const int y1 = glm::min(static_cast<int>(glm::ceil(hi.y)), min_y + h - 1);
+
+    for (int y = y0; y <= y1; y++) {
+      for (int x = x0; x <= x1; x++) {
+        const glm::vec2 q = glm::vec2(x, y) - s_tri[0];
+        const float b1 = (q.x * e2.y - e2.x * q.y) / area;
+        const float b2 = (e1.x * q.y - q.x * e1.y) / area;
+        const glm::vec3 bc(1 - b1 - b2, b1, b2);
+        // slightly conservative, the ray test is inclusive and a false
+        // positive only costs a ray
+        if (bc[0] < -1e-3f || bc[1] < -1e-3f || bc[2] < -1e-3f) {
+          continue;
+        }
+
+        // window z is affine in screen space, so it can be interpolated as is
+        const float z = ss[0].z + b1 * dz1 + b2 * dz2;
+        size_t ix = (y - min_y) * w + (x - min_x);
+        // on an edge, or where another triangle is about as close, the ray
+        // might pick a different triangle than the raster, which the shadow
+        // test depends on, so let the ray decide
+        if (z < depth[ix] - 1e-6f) {
+          const bool edge = bc[0] < 1e-3f || bc[1] < 1e-3f || bc[2] < 1e-3f;
+          ids[ix] = edge ? -2 : i;
+          depth[ix] = z;
+        } else if (z < depth[ix] + 1e-6f) {
+          ids[ix] = -2;
+          depth[ix] = glm::min(depth[ix], z);
+        }
+      }
+    }
+  }
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int id = ids[y * w + x];
+      if (id != -1) {
+        fragments.push_back(
+            {glmt::vec2p(min_x + x, min_y + y), glm::max(id, -1)});
+      }
+    }
+  }
+
+  return fragments;
+}
+
+#include <functional>
+#include <utility>
+
+// a pixel from one of the per pixel modes, in HDR
+struct Shade {
+  glm::vec3 colour;
+  float invz;
+  bool hit; // nothing is written otherwise
+  unsigned int frame = -1; // when it was stored, so stale ones are ignored
+  unsigned int samples = 1; // colour and invz are the mean of
+  float error = 0; // relative, of the mean, see shade_adaptive
+};
+
+float luminance(const glm::vec3 &colour) {
+  return glm::dot(colour, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// running sums of the samples of a pixel, for their mean and how sure it is,
+// judged by measure, the luminance unless the caller knows what varies
+struct Estimate {
+  glm::vec3 sum = glm::vec3(0);
+  float measure = 0;
+  float squares = 0; // of measure
+  unsigned int count = 0;
+
+  void add(const glm::vec3 &colour) { add(colour, luminance(colour)); }
+  void add(const glm::vec3 &colour, float m) {
+    sum += colour;
+    measure += m;
+    squares += m * m;
+    count++;
+  }
+  glm::vec3 mean() const { return sum / static_cast<float>(count); }
+  // standard error of the mean measure relative to it, 0 until there are two
+  // samples
+  float error() const {
+    if (count < 2) {
+      return 0;
+    }
+    const float m = measure / count;
+    const float variance =
+        glm::max(squares - count * m * m, 0.f) / (count - 1);
+    return glm::sqrt(variance / count) / glm::max(glm::abs(m), 1e-3f);
+  }
+};
+
+// adaptive sampling, every pixel has been shaded with its first samples and
+// the ones least sure of their colour take the other total - first as well,
+// most unsure first, for as long as budget lasts. at(i) points to pixel i's
+// Shade or is null if it was not shaded, shade(i, first, count) shades it
+// with samples [first, first + count)
+template <typename A, typename F>
+void shade_adaptive(size_t n, A at, F shade, unsigned int first,
+                    unsigned int total, size_t &budget) {
+  // past this error a pixel has not converged
+  const float TOLERANCE = 0.05f;
+  if (total <= first) {
+    return;
+  }
+  const unsigned int extra = total - first;
+
+  std::vector<std::pair<float, size_t>> unsure;
+  for (size_t i = 0; i < n; i++) {
+    const Shade *s = at(i);
+    if (s != nullptr && s->hit && s->error > TOLERANCE) {
+      unsure.push_back(std::make_pair(s->error, i));
+    }
+  }
+  const size_t count = glm::min(unsure.size(), budget / extra);
+  std::partial_sort(unsure.begin(), unsure.begin() + count, unsure.end(),
+                    std::greater<std::pair<float, size_t>>());
+  budget -= count * extra;
+
+#pragma omp parallel for
+  for (size_t u = 0; u < count; u++) {
+    Shade &s = *at(unsure[u].second);
+    const Shade more = shade(unsure[u].second, first, extra);
+    const float a = s.samples;
+    const float b = more.samples;
+    s.error *= glm::sqrt(a / (a + b)); // roughly, as it is not looked at again
+    s.colour = (a * s.colour + b * more.colour) / (a + b);
+    s.invz = (a * s.invz + b * more.invz) / (a + b);
+    s.samples += more.samples;
+  }
+}
+
+// whether a pixel is shaded this frame at a shading rate of 1, 2 (a
+// checkerboard) or 4 (one pixel of each 2x2 quad), the pattern moves every
+// frame so each pixel is shaded at least every rate frames
+bool shaded(unsigned int x, unsigned int y, unsigned int frame, int rate) {
+  if (rate == 2) {
+    return ((x + y + frame) & 1) == 0;
+  } else if (rate == 4) {
+    return (x & 1) + 2 * (y & 1) == frame % 4;
+  }
+  return true;
+}
+
+// shade_sparse scratch space kept between frames, a Shade per pixel of a
+// width by height window
+struct Sparse {
+  std::vector<Shade> samples;
+  std::vector<Shade> history;
+  unsigned int width = 0;
+  unsigned int height = 0;
+};
+
+// variable rate shading, only pixels which are shaded() call shade(i, 0,
+// first) for pixels[i], and take up to total samples as shade_adaptive sees
+// fit. the others are reconstructed from the shaded ones around them, with
+// last frame's pixel clamped to their range so still images keep full
+// detail, or shaded anyway if they lie on an edge. scratch is started over
+// when the size of the window changes
+template <typename F>
+void shade_sparse(sdw::framebuffer window,
+                  const std::vector<glmt::vec2p> &pixels, F shade,
+                  unsigned int frame, int rate, unsigned int first,
+                  unsigned int total, size_t &budget, Sparse &scratch) {
+  // past this difference between neighbours a pixel is on an edge
+  const float CONTRAST = 0.1f;
+  const size_t size = window.width * window.height;
+  if (scratch.width != window.width || scratch.height != window.height) {
+    // last frame's pixels would be read from where other pixels are now
+    scratch.samples.assign(size, Shade());
+    scratch.history.assign(size, Shade());
+    scratch.width = window.width;
+    scratch.height = window.height;
+  }
+  std::vector<Shade> &samples = scratch.samples;
+  std::vector<Shade> &history = scratch.history;
+
+#pragma omp parallel for
+  for (size_t i = 0; i < pixels.size(); i++) {
+    const glmt::vec2p p = pixels[i];
+    if (shaded(p.x, p.y, frame, rate)) {
+      samples[p.y * window.width + p.x] = shade(i, 0, first);
+      samples[p.y * window.width + p.x].frame = frame;
+    }
+  }
+  shade_adaptive(
+      pixels.size(),
+      [&](size_t i) -> Shade * {
+        Shade &s = samples[pixels[i].y * window.width + pixels[i].x];
+        return s.frame == frame ? &s : nullptr;
+      },
+      shade, first, total, budget);
+
+  std::vector<Shade> result(pixels.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < pixels.size(); i++) {
+    const glmt::vec2p p = pixels[i];
+    const size_t index = p.y * window.width + p.x;
+    if (samples[index].frame == frame) {
+      result[i] = samples[index];
+      continue;
+    }
+
+    int hits = 0;
+    int misses = 0;
+    Shade mean;
+    mean.colour = glm::vec3(0);
+    mean.invz = 0;
+    mean.hit = true;
+    glm::vec3 min(std::numeric_limits<float>::max());
+    glm::vec3 max(std::numeric_limits<float>::lowest());
+    const int px = p.x;
+    const int py = p.y;
+    for (int y = glm::max(py - 1, 0);
+         y <= glm::min(py + 1, int(window.height) - 1); y++) {
+      for (int x = glm::max(px - 1, 0);
+           x <= glm::min(px + 1, int(window.width) - 1); x++) {
+        const Shade &n = samples[y * window.width + x];
+        if (n.frame != frame) {
+          continue; // not shaded this frame
+        } else if (!n.hit) {
+          misses++;
+          continue;
+        }
+        hits++;
+        mean.colour += n.colour;
+        mean.invz += n.invz;
+        min = glm::min(min, n.colour);
+        max = glm::max(max, n.colour);
+      }
+    }
+
+    if (hits == 0 && misses > 0) {
+      result[i].hit = false;
+    } else if (hits == 0 || misses > 0 ||
+               glm::compMax(max - min) > CONTRAST * glm::compMax(max)) {
+      // isolated or an edge, where guessing shows
+      result[i] = shade(i, 0, first);
+    } else {
+      const Shade &last = history[index];
+      mean.colour /= hits;
+      mean.invz /= hits;
+      if (last.frame == frame - 1 && last.hit) {
+        mean.colour = glm::clamp(last.colour, min, max);
+      }
+      result[i] = mean;
+    }
+  }
+
+  // written a run at a time through the row it is on, as the pixels come
+  // in rows from left to right
+  std::vector<size_t> runs;
+  for (size_t i = 0; i < pixels.size(); i++) {
+    if (i == 0 || pixels[i].y != pixels[i - 1].y ||
+        pixels[i].x <= pixels[i - 1].x) {
+      runs.push_back(i);
+    }
+  }
+  runs.push_back(pixels.size());
+#pragma omp parallel for
+  for (size_t r = 0; r < runs.size() - 1; r++) {
+    const sdw::framebuffer::span row = window.row(
+        pixels[runs[r]].y, pixels[runs[r]].x, pixels[runs[r + 1] - 1].x);
+    for (size_t i = runs[r]; i < runs[r + 1]; i++) {
+      const glmt::vec2p p = pixels[i];
+      result[i].frame = frame;
+      history[p.y * window.width + p.x] = result[i];
+      if (result[i].hit) {
+        row.set(p.x, result[i].invz, result[i].colour);
+      }
+    }
+  }
 }
 
 // https://en.wikipedia.org/wiki/Tone_mapping
@@ -588,6 +1500,540 @@ glm::vec3 tm_aces_approx(glm::vec3 colour) {
                     0.0f, 1.0f);
 }
 
+// the tone map for everything shaded in HDR, also given to the framebuffer so
+// pixels read back before tonemap look as they will after it
+uint32_t tm_argb8888(const glm::vec3 &colour) {
+  return glmt::rgbf01(tm_aces(colour)).argb8888();
+}
+
+// tone maps and packs every pixel which was shaded in HDR, once per frame
+// rather than once per overdrawn fragment
+void tonemap(sdw::framebuffer window) {
+  const unsigned int TILE = sdw::framebuffer::TILE;
+#pragma omp parallel for
+  for (unsigned int y = 0; y < window.height; y++) {
+    for (unsigned int x0 = 0; x0 < window.width; x0 += TILE) {
+      if (window.stale(x0, y)) {
+        continue; // nothing was drawn here
+      }
+      const unsigned int x1 = glm::min(x0 + TILE, window.width) - 1;
+      const sdw::framebuffer::span row = window.row(y, x0, x1);
+      for (unsigned int x = x0; x <= x1; x++) {
+        // mapped regardless and selected after, so the loop has no branches
+        const unsigned int i = row.at(x);
+        const uint32_t packed = tm_argb8888(row.hdr[i]);
+        row.colour[i] =
+            row.colour[i] == sdw::framebuffer::HDR ? packed : row.colour[i];
+      }
+    }
+  }
+}
+
+// fast approximate anti-aliasing, after Timothy Lottes' FXAA, over the tone
+// mapped frame: pixels on a luma edge are blended with the pixel across it by
+// how far along the edge they are, so stair steps become gradients
+//
+// colours, lumas and edges are scratch space kept between frames
+void fxaa(sdw::framebuffer window, std::vector<uint32_t> &colours,
+          std::vector<float> &lumas, std::vector<uint8_t> &edges) {
+  const float EDGE_THRESHOLD = 1 / 8.f; // of the local maximum
+  const float EDGE_THRESHOLD_MIN = 1 / 16.f; // skips dark noise
+  const float SUBPIXEL = 0.75f; // how much single pixel features are softened
+  const int SEARCH_STEPS = 12;  // pixels along an edge to look for its ends
+
+  const int width = window.width;
+  const int height = window.height;
+  colours.resize(width * height);
+  lumas.resize(width * height);
+  edges.resize(width * height);
+  // read from a copy so blends never see pixels which were already blended
+  window.copyPixels(colours.data(), width,
+                    sdw::framebuffer::rect{0, 0, window.width, window.height});
+
+#pragma omp parallel for
+  for (int i = 0; i < width * height; i++) {
+    // green weighted, close enough to perceived brightness for finding edges
+    const uint32_t c = colours[i];
+    lumas[i] = ((c >> 16 & 0xff) * 0.299f + (c >> 8 & 0xff) * 0.587f +
+                (c & 0xff) * 0.114f) /
+               255.f;
+  }
+
+  // a cheap pass without branches finds the few pixels worth a closer look,
+  // the edges of the frame are always looked at as they need clamping
+#pragma omp parallel for
+  for (int y = 0; y < height; y++) {
+    const float *l = &lumas[y * width];
+    const float *above = &lumas[glm::max(y - 1, 0) * width];
+    const float *below = &lumas[glm::min(y + 1, height - 1) * width];
+    uint8_t *edge = &edges[y * width];
+    edge[0] = edge[width - 1] = 1;
+    for (int x = 1; x < width - 1; x++) {
+      const float max = glm::max(glm::max(glm::max(above[x], below[x]),
+                                          glm::max(l[x - 1], l[x + 1])),
+                                 l[x]);
+      const float min = glm::min(glm::min(glm::min(above[x], below[x]),
+                                          glm::min(l[x - 1], l[x + 1])),
+                                 l[x]);
+      edge[x] =
+          max - min >= glm::max(EDGE_THRESHOLD_MIN, max * EDGE_THRESHOLD);
+    }
+  }
+
+  const auto luma = [&](int x, int y) {
+    return lumas[glm::clamp(y, 0, height - 1) * width +
+                 glm::clamp(x, 0, width - 1)];
+  };
+  const auto colour = [&](int x, int y) {
+    return colours[glm::clamp(y, 0, height - 1) * width +
+                   glm::clamp(x, 0, width - 1)];
+  };
+
+#pragma omp parallel for
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      if (!edges[y * width + x]) {
+        continue; // by far the most pixels, nothing to smooth
+      }
+      const float m = luma(x, y);
+      const float n = luma(x, y - 1);
+      const float s = luma(x, y + 1);
+      const float w = luma(x - 1, y);
+      const float e = luma(x + 1, y);
+      const float max = glm::max(glm::max(glm::max(n, s), glm::max(w, e)), m);
+      const float min = glm::min(glm::min(glm::min(n, s), glm::min(w, e)), m);
+      const float range = max - min;
+      if (range < glm::max(EDGE_THRESHOLD_MIN, max * EDGE_THRESHOLD)) {
+        continue;
+      }
+
+      const float nw = luma(x - 1, y - 1);
+      const float ne = luma(x + 1, y - 1);
+      const float sw = luma(x - 1, y + 1);
+      const float se = luma(x + 1, y + 1);
+
+      // single pixel features have no edge to search along, so are blended
+      // by how much they stand out
+      const float average = (2 * (n + s + w + e) + (nw + ne + sw + se)) / 12.f;
+      const float contrast =
+          glm::clamp(glm::abs(average - m) / range, 0.f, 1.f);
+      const float smooth = (3 - 2 * contrast) * contrast * contrast;
+      const float subpixel = smooth * smooth * SUBPIXEL;
+
+      // an edge runs along the direction with less change
+      const bool horizontal =
+          glm::abs(nw + sw - 2 * w) + 2 * glm::abs(n + s - 2 * m) +
+              glm::abs(ne + se - 2 * e) >=
+          glm::abs(nw + ne - 2 * n) + 2 * glm::abs(w + e - 2 * m) +
+              glm::abs(sw + se - 2 * s);
+      // across is towards the side of the edge with the steeper gradient
+      const float l0 = horizontal ? n : w;
+      const float l1 = horizontal ? s : e;
+      const bool negative = glm::abs(l0 - m) >= glm::abs(l1 - m);
+      const int ax = horizontal ? 0 : (negative ? -1 : 1);
+      const int ay = horizontal ? (negative ? -1 : 1) : 0;
+      const int dx = horizontal ? 1 : 0;
+      const int dy = horizontal ? 0 : 1;
+
+      const float gradient = glm::abs((negative ? l0 : l1) - m) / 4;
+      const float edge = ((negative ? l0 : l1) + m) / 2;
+
+      // walks both ways along the middle of the edge until it ends, where
+      // its luma strays from the edge's
+      const auto end = [&](int direction, float &dist, float &delta) {
+        for (int i = 1; i <= SEARCH_STEPS; i++) {
+          const int ex = x + direction * i * dx;
+          const int ey = y + direction * i * dy;
+          delta = (luma(ex, ey) + luma(ex + ax, ey + ay)) / 2 - edge;
+          dist = i;
+          if (glm::abs(delta) >= gradient) {
+            return;
+          }
+        }
+      };
+      float distN = 0, distP = 0, deltaN = 0, deltaP = 0;
+      end(-1, distN, deltaN);
+      end(+1, distP, deltaP);
+
+      // the nearer end decides which way the edge steps, only pixels on the
+      // side of it which the step goes to are blended
+      const float delta = distN < distP ? deltaN : deltaP;
+      const float offset =
+          (delta < 0) != (m - edge < 0)
+              ? 0.5f - glm::min(distN, distP) / (distN + distP)
+              : 0;
+      const float blend = glm::max(offset, subpixel);
+
+      const uint32_t a = colours[y * width + x];
+      const uint32_t b = colour(x + ax, y + ay);
+      uint32_t blended = a & 0xff000000;
+      for (int ch = 0; ch < 24; ch += 8) {
+        const float mixed = glm::mix<float>(a >> ch & 0xff, b >> ch & 0xff,
+                                            blend);
+        blended |= static_cast<uint32_t>(mixed + 0.5f) << ch;
+      }
+      const sdw::framebuffer::span row = window.row(y, x, x);
+      row.colour[row.at(x)] = blended;
+    }
+  }
+}
+
+// the i-th element of the van der Corput sequence in base, which fills [0, 1)
+// evenly however far along it is taken
+float halton(unsigned int i, unsigned int base) {
+  float f = 1;
+  float r = 0;
+  while (i > 0) {
+    f /= base;
+    r += f * (i % base);
+    i /= base;
+  }
+  return r;
+}
+
+// temporal anti-aliasing, with the projection moved by a sub-pixel jitter each
+// frame every pixel is a different sample of the area it covers, so blending
+// each with where it was in the last frames averages those samples
+//
+// where it was comes from its depth and how the camera moved, viewproj and
+// previous are without the jitter, and history is clamped to the colours
+// around the pixel now so it does not smear what moved or was disoccluded
+//
+// history is kept between frames, and started over when the size of the
+// frame changes
+void taa(sdw::framebuffer window, const glm::mat4 &viewproj,
+         const glm::mat4 &previous, glm::vec2 jitter,
+         std::vector<glm::vec3> &history) {
+  const float ALPHA = 0.1f; // of the current frame in what is shown
+
+  const int width = window.width;
+  const int height = window.height;
+  std::vector<glm::vec3> current(width * height);
+  std::vector<float> invz(width * height);
+
+#pragma omp parallel for
+  for (int y = 0; y < height; y++) {
+    const sdw::framebuffer::span row = window.row(y, 0, width - 1);
+    for (int x = 0; x < width; x++) {
+      const unsigned int i = row.at(x);
+      current[y * width + x] =
+          glm::vec3(glmt::rgba8888::fromargb8888packed(row.colour[i])) / 255.f;
+      invz[y * width + x] = sdw::depth_format::invz(row.depth[i]);
+    }
+  }
+  if (history.size() != current.size()) {
+    history = current;
+    return;
+  }
+
+  const glm::mat4 reproject = previous * glm::inverse(viewproj);
+  const auto at = [&](const std::vector<glm::vec3> &buffer, int x, int y) {
+    return buffer[glm::clamp(y, 0, height - 1) * width +
+                  glm::clamp(x, 0, width - 1)];
+  };
+
+  std::vector<glm::vec3> next(width * height);
+#pragma omp parallel for
+  for (int y = 0; y < height; y++) {
+    const sdw::framebuffer::span row = window.row(y, 0, width - 1);
+    for (int x = 0; x < width; x++) {
+      const glm::vec3 colour = current[y * width + x];
+
+      // where the pixel's sample was without the jitter, in window space as
+      // glm::project leaves it, nothing drawn is as far away as it gets
+      const float z =
+          invz[y * width + x] > 0 ? sdw::window_z(invz[y * width + x]) : 1;
+      const glm::vec4 ndc((x - jitter.x) / width * 2 - 1,
+                          (y - jitter.y) / height * 2 - 1, z * 2 - 1, 1);
+      glm::vec4 then = reproject * ndc;
+      then /= then.w;
+      const glm::vec2 p((then.x + 1) / 2 * width, (then.y + 1) / 2 * height);
+
+      glm::vec3 blended = colour;
+      if (p.x > -0.5f && p.x < width - 0.5f && p.y > -0.5f &&
+          p.y < height - 0.5f) {
+        const glm::ivec2 p0 = glm::floor(p);
+        const glm::vec2 f = p - glm::vec2(p0);
+        // bilinear, as it was seldom exactly on a pixel
+        glm::vec3 past = glm::mix(glm::mix(at(history, p0.x, p0.y),
+                                           at(history, p0.x + 1, p0.y), f.x),
+                                  glm::mix(at(history, p0.x, p0.y + 1),
+                                           at(history, p0.x + 1, p0.y + 1),
+                                           f.x),
+                                  f.y);
+
+        glm::vec3 min = colour;
+        glm::vec3 max = colour;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            min = glm::min(min, at(current, x + dx, y + dy));
+            max = glm::max(max, at(current, x + dx, y + dy));
+          }
+        }
+        past = glm::clamp(past, min, max);
+        blended = glm::mix(past, colour, ALPHA);
+      }
+
+      next[y * width + x] = blended;
+      row.colour[row.at(x)] = glmt::rgbf01(blended).argb8888();
+    }
+  }
+  history.swap(next);
+}
+
+// progressive refinement of a still scene, shows the mean of every frame since
+// count was last reset, which converges on the supersampled image as long as
+// each frame is jittered
+//
+// before tonemap, like downsample: HDR pixels are summed linear into hdr,
+// with how many frames they were HDR in w, and packed ones are summed as they
+// are into packed. a pixel only ever shaded in HDR is left the HDR mean to be
+// tone mapped with the rest, others mix the tone mapped HDR mean into theirs
+void accumulate(sdw::framebuffer window, std::vector<glm::vec4> &hdr,
+                std::vector<glm::vec3> &packed, unsigned int &count) {
+  const int width = window.width;
+  const int height = window.height;
+  if (hdr.size() != size_t(width * height)) {
+    hdr.resize(width * height);
+    packed.resize(width * height);
+    count = 0;
+  }
+  if (count == 0) {
+    std::fill(hdr.begin(), hdr.end(), glm::vec4(0));
+    std::fill(packed.begin(), packed.end(), glm::vec3(0));
+  }
+  count++;
+
+#pragma omp parallel for
+  for (int y = 0; y < height; y++) {
+    const sdw::framebuffer::span row = window.row(y, 0, width - 1);
+    glm::vec4 *linear = &hdr[y * width];
+    glm::vec3 *total = &packed[y * width];
+    for (int x = 0; x < width; x++) {
+      const unsigned int i = row.at(x);
+      const uint32_t c = row.colour[i];
+      if (c == sdw::framebuffer::HDR) {
+        linear[x] += glm::vec4(row.hdr[i], 1);
+      } else {
+        total[x] += glm::vec3(c >> 16 & 0xff, c >> 8 & 0xff, c & 0xff);
+      }
+
+      const float shaded = linear[x].w;
+      if (shaded == count) {
+        row.colour[i] = sdw::framebuffer::HDR;
+        row.hdr[i] = glm::vec3(linear[x]) / shaded;
+        continue;
+      }
+      glm::vec3 sum = total[x];
+      if (shaded > 0) {
+        sum += shaded * 255.f *
+               glm::clamp(tm_aces(glm::vec3(linear[x]) / shaded),
+                          glm::vec3(0), glm::vec3(1));
+      }
+      // rounded, so a pixel which never changes keeps its exact colour
+      const glm::uvec3 mean(sum / float(count) + 0.5f);
+      row.colour[i] = 0xff000000 | mean.r << 16 | mean.g << 8 | mean.b;
+    }
+  }
+}
+
+#include <type_traits>
+
+enum class FILTER {
+  BOX,  // the average of the samples of each pixel
+  TENT, // reaches into the neighbouring pixels' samples, less aliasing
+};
+
+// how far sample j is from the middle of the first factor samples, in halves
+// of a sample
+constexpr int half_distance(int j, int factor) {
+  return 2 * j + 1 > factor ? 2 * j + 1 - factor : factor - 2 * j - 1;
+}
+
+// weight of the source row or column j samples from the start of a pixel's
+// FACTOR samples, the tent falls to 0 a pixel away from the middle
+template <unsigned int FACTOR, FILTER F>
+constexpr uint32_t downsample_weight(int j) {
+  return F == FILTER::BOX ? (j >= 0 && j < int(FACTOR) ? 1 : 0)
+         : half_distance(j, FACTOR) < 2 * int(FACTOR)
+             ? 2 * int(FACTOR) - half_distance(j, FACTOR)
+             : 0;
+}
+
+template <unsigned int FACTOR, FILTER F>
+constexpr uint32_t downsample_total(int j = -int(FACTOR)) {
+  return j == int(2 * FACTOR) ? 0
+                              : downsample_weight<FACTOR, F>(j) +
+                                    downsample_total<FACTOR, F>(j + 1);
+}
+
+// adds the weighted columns of a row's plane under each of width output
+// pixels into sums, a tap at a time so each loop is a plain strided walk
+template <unsigned int FACTOR, FILTER F, typename T, typename U>
+void downsample_columns(const T *plane, U *sums, int width, int columns) {
+  const int TAPS = 3 * FACTOR; // from FACTOR before to FACTOR after
+  for (int j = 0; j < TAPS; j++) {
+    const U weight = downsample_weight<FACTOR, F>(j - FACTOR);
+    if (weight == 0) {
+      continue;
+    }
+    // the taps of the first and last pixels may fall outside of the row
+    const int offset = j - int(FACTOR);
+    const int x0 = offset < 0 ? 1 : 0;
+    const int x1 =
+        (width - 1) * int(FACTOR) + offset >= columns ? width - 1 : width;
+    // from 0 with the start folded into the pointers, which vectorises
+    const T *source = plane + x0 * FACTOR + offset;
+    U *sum = sums + x0;
+    for (int x = 0; x < x1 - x0; x++) {
+      sum[x] += weight * source[x * FACTOR];
+    }
+    for (int x = 0; x < width; x += glm::max(width - 1, 1)) {
+      if (x < x0 || x >= x1) {
+        const int sx = glm::clamp(x * int(FACTOR) + offset, 0, columns - 1);
+        sums[x] += weight * plane[sx];
+      }
+    }
+  }
+}
+
+// resolves src into dst, which is FACTOR times smaller and is left packed,
+// before src is tone mapped: HDR samples are averaged and the mean is tone
+// mapped, as tone mapping each sample first would darken the edges between
+// bright and dark ones, and packed samples are averaged as they are. dst
+// takes the depth of each pixel's nearest sample too
+//
+// packed samples are summed as integers per channel, which vectorise far
+// better than unpacking them into float colours, and the HDR ones only take
+// the float planes in rows which have any. both filters are separable, so
+// each output row first sums the source rows under it weighted, then each
+// output pixel sums the columns under it, the weights and their total are
+// constant so the loops unroll and the divide is a multiply
+template <unsigned int FACTOR, FILTER F>
+void downsample(sdw::framebuffer src, sdw::framebuffer dst) {
+  const uint32_t norm =
+      downsample_total<FACTOR, F>() * downsample_total<FACTOR, F>();
+  const int TAPS = 3 * FACTOR; // from FACTOR before to FACTOR after
+  // twice the lanes where the weighted sums still fit
+  typedef typename std::conditional<255 * downsample_total<FACTOR, F>() <=
+                                        0xffff,
+                                    uint16_t, uint32_t>::type column;
+  typedef typename std::conditional<255 * downsample_total<FACTOR, F>() *
+                                            downsample_total<FACTOR, F>() <=
+                                        0xffff,
+                                    uint16_t, uint32_t>::type pixel;
+
+  const int width = glm::min(src.width / FACTOR, dst.width);
+  const int height = glm::min(src.height / FACTOR, dst.height);
+  const int columns = src.width;
+#pragma omp parallel
+  {
+    // scratch for an output row, a set per thread: a plane for each of red,
+    // green and blue, alpha is always opaque, then the same in HDR with the
+    // weight of the HDR samples, and their sums across the columns
+    std::vector<column> planes(3 * columns);
+    column *r = &planes[0];
+    column *g = &planes[columns];
+    column *b = &planes[2 * columns];
+    std::vector<float> hdr_planes(4 * columns);
+    float *hr = &hdr_planes[0];
+    float *hg = &hdr_planes[columns];
+    float *hb = &hdr_planes[2 * columns];
+    float *hw = &hdr_planes[3 * columns];
+    std::vector<pixel> sums(3 * width);
+    pixel *red = &sums[0];
+    pixel *green = &sums[width];
+    pixel *blue = &sums[2 * width];
+    std::vector<float> hdr_sums(4 * width);
+    float *hdr_red = &hdr_sums[0];
+    float *hdr_green = &hdr_sums[width];
+    float *hdr_blue = &hdr_sums[2 * width];
+    float *hdr_weight = &hdr_sums[3 * width];
+    // depth is not filtered, each pixel takes the nearest of its own samples
+    // so taa reprojects it by what is in front
+    std::vector<sdw::depth_format::type> depths(width);
+
+#pragma omp for
+    for (int y = 0; y < height; y++) {
+      std::fill(planes.begin(), planes.end(), 0);
+      std::fill(hdr_planes.begin(), hdr_planes.end(), 0.f);
+      std::fill(depths.begin(), depths.end(), sdw::depth_format::clear());
+      bool hdr = false;
+      for (int j = 0; j < TAPS; j++) {
+        const column weight = downsample_weight<FACTOR, F>(j - FACTOR);
+        if (weight == 0) {
+          continue;
+        }
+        const int sy = glm::clamp(int(y * FACTOR) + j - int(FACTOR), 0,
+                                  int(src.height) - 1);
+        const sdw::framebuffer::span row = src.row(sy, 0, columns - 1);
+        for (int i = 0; i < columns; i++) {
+          const unsigned int at = row.at(i);
+          // selected rather than branched on, so the loop still vectorises,
+          // and so the HDR values of packed samples are never read into a
+          // sum
+          const bool shaded = row.colour[at] == sdw::framebuffer::HDR;
+          const uint32_t colour = shaded ? 0 : row.colour[at];
+          r[i] += weight * (colour >> 16 & 0xff);
+          g[i] += weight * (colour >> 8 & 0xff);
+          b[i] += weight * (colour & 0xff);
+          hr[i] += shaded ? weight * row.hdr[at].r : 0.f;
+          hg[i] += shaded ? weight * row.hdr[at].g : 0.f;
+          hb[i] += shaded ? weight * row.hdr[at].b : 0.f;
+          hw[i] += shaded ? weight : 0.f;
+          hdr |= shaded;
+        }
+        if (j < int(FACTOR) || j >= int(2 * FACTOR)) {
+          continue; // a neighbour's row, only the tent reaches it
+        }
+        for (int x = 0; x < width; x++) {
+          for (unsigned int k = 0; k < FACTOR; k++) {
+            const sdw::depth_format::type d = row.depth[row.at(x * FACTOR + k)];
+            depths[x] = sdw::depth_format::closer(depths[x], d) ? d : depths[x];
+          }
+        }
+      }
+
+      // then the same across the columns
+      std::fill(sums.begin(), sums.end(), 0);
+      downsample_columns<FACTOR, F>(r, red, width, columns);
+      downsample_columns<FACTOR, F>(g, green, width, columns);
+      downsample_columns<FACTOR, F>(b, blue, width, columns);
+
+      const sdw::framebuffer::span row = dst.row(y, 0, width - 1);
+      for (int x = 0; x < width; x++) {
+        row.depth[row.at(x)] = depths[x];
+      }
+      if (!hdr) {
+        for (int x = 0; x < width; x++) {
+          row.colour[row.at(x)] = 0xff000000 |
+                                  (red[x] + norm / 2) / norm << 16 |
+                                  (green[x] + norm / 2) / norm << 8 |
+                                  (blue[x] + norm / 2) / norm;
+        }
+        continue;
+      }
+
+      std::fill(hdr_sums.begin(), hdr_sums.end(), 0.f);
+      downsample_columns<FACTOR, F>(hr, hdr_red, width, columns);
+      downsample_columns<FACTOR, F>(hg, hdr_green, width, columns);
+      downsample_columns<FACTOR, F>(hb, hdr_blue, width, columns);
+      downsample_columns<FACTOR, F>(hw, hdr_weight, width, columns);
+      for (int x = 0; x < width; x++) {
+        glm::vec3 colour(red[x], green[x], blue[x]);
+        if (hdr_weight[x] > 0) {
+          const glm::vec3 mean =
+              glm::vec3(hdr_red[x], hdr_green[x], hdr_blue[x]) / hdr_weight[x];
+          colour += hdr_weight[x] * 255.f *
+                    glm::clamp(tm_aces(mean), glm::vec3(0), glm::vec3(1));
+        }
+        const glm::uvec3 c(glm::min(colour / float(norm) + 0.5f, 255.f));
+        row.colour[row.at(x)] = 0xff000000 | c.r << 16 | c.g << 8 | c.b;
+      }
+    }
+  }
+}
+
 // strictly for what is supported for rendering, whereas glmt::OBJ may include
 // more data that the renderer does not support
 struct Model {
@@ -707,46 +2153,23 @@ struct PointLight {
   glm::vec3 specular() const { return spec_c * spec_b; }
 };
 
-void filledtriangle(sdw::window window, std::array<glmt::vec3s, 3> transformed,
+void filledtriangle(sdw::framebuffer window,
+                    std::array<glmt::vec3s, 3> transformed,
                     std::array<glmt::rgbf01, 3> colours) {
-
-  std::array<glmt::vec2s, 3> s_tri{glm::vec2(transformed[0]),
-                                   glm::vec2(transformed[1]),
-                                   glm::vec2(transformed[2])};
-  glmt::bound2s bounds(s_tri.begin(), s_tri.end());
-
-  bounds.min.x = glm::max(glm::floor(bounds.min.x), 0.f);
-  bounds.min.y = glm::max(glm::floor(bounds.min.y), 0.f);
-  bounds.max.x = glm::min(glm::ceil(bounds.max.x), (float)window.width);
-  bounds.max.y = glm::min(glm::ceil(bounds.max.y), (float)window.height);
-
-  for (int y = bounds.min.y; y <= bounds.max.y; y++) {
-    for (int x = bounds.min.x; x <= bounds.max.x; x++) {
-      glm::vec3 bc = barycentric(glmt::vec2s(x, y), s_tri);
-      if (bc[0] <= 0 || bc[1] <= 0 || bc[2] <= 0) {
-        // outside of triangle
-        continue;
+  rasterise(window, transformed, [&](const glm::vec3 &bc, float zinv) {
+    // naive vertex interpolation
+    // glm::vec3 col =
+    //     bc[0] * colours[0] + bc[1] * colours[1] + bc[2] * colours[2];
+    glm::vec3 col(0);
+    {
+      // perspective corrected col
+      for (int i = 0; i < 3; ++i) {
+        col += bc[i] * colours[i] / transformed[i].w;
       }
-
-      float zinv = bc[0] / transformed[0].z + bc[1] / transformed[1].z +
-                   bc[2] / transformed[2].z;
-
-      // naive vertex interpolation
-      // glm::vec3 col =
-      //     bc[0] * colours[0] + bc[1] * colours[1] + bc[2] * colours[2];
-      glm::vec3 col(0);
-      {
-        // perspective corrected col
-        for (int i = 0; i < 3; ++i) {
-          col += bc[i] * colours[i] / transformed[i].z;
-        }
-        col /= zinv;
-      }
-      glmt::rgbf01 c = tm_aces(col);
-
-      window.setPixelColour(glmt::vec2p(x, y), zinv, c.argb8888());
+      col /= zinv;
     }
-  }
+    return col;
+  });
 }
 
 // assumes all vec3 are normalized
@@ -776,11 +2199,16 @@ glm::vec4 triangle_normal(std::array<glm::vec4, 3> triangle) {
   return glm::vec4(normal, 1.0);
 };
 
+// how far short of the intersection shadow rays stop, as it is only on its
+// triangle to within rounding, in camera space units
+const float SHADOW_BIAS = 1e-3f;
+
+// lit is whether the shadow ray from the light reached the intersection
 glm::vec3 pathtrace_light(
     const Model &model,
     const std::vector<std::array<glm::vec4, 3>> &triangles, // camera space
     const PointLight &light, const glm::vec4 &ray,
-    const Intersection &intersection) {
+    const Intersection &intersection, bool lit) {
   const glm::vec3 model_c = model.colours[intersection.triangleIndex];
 
   // // cheat emmissiveness, add Kd and Ks to Model sometime
@@ -793,109 +2221,119 @@ glm::vec3 pathtrace_light(
   // TODO: if moved, use <glm/gtx/norm.hpp> length2
   float radius = glm::length(-intersection.position + light.pos);
 
-  Intersection to_light;
-  if (ClosestIntersection(light.pos, -r, triangles, to_light)) {
-    // light -> triangles for floating point lights normally removes the need to
-    // for a small normal bias
-    if (to_light.triangleIndex != intersection.triangleIndex) {
-      glm::vec3 ambient = light.ambient();
-      return (model_c * (ambient));
-    }
+  if (!lit) {
+    glm::vec3 ambient = light.ambient();
+    return (model_c * (ambient));
   }
 
   return (model_c * phong(light, radius, glm::vec3(r), glm::vec3(n),
                           glm::normalize(glm::vec3(ray))));
 }
 
-glmt::rgbf01 pathtrace_light(
+// light as a sphere of radius light.diffusion, as count point lights spread
+// evenly over it, one per band of equal area with each turned by the golden
+// angle from the last, 1 is just the centre. light is in camera space, the
+// samples are spread in world space and moved into camera space with view.
+// sequence 0 is the middle of each band, others are jittered within them.
+// the bands are taken a stride apart, so any first few samples cover the
+// whole light for shade_adaptive
+std::vector<PointLight> sample_light(const PointLight &light,
+                                     const glm::mat4 &view, unsigned int count,
+                                     unsigned int sequence = 0) {
+  std::vector<PointLight> samples(count, light);
+  if (count == 1) {
+    return samples;
+  }
+  const float golden = glm::pi<float>() * (3 - glm::sqrt(5.f));
+  const float band = sequence > 0 ? halton(sequence, 2) : 0.5f;
+  const float turn =
+      sequence > 0 ? 2 * glm::pi<float>() * halton(sequence, 3) : 0;
+  // near count / the golden ratio, and coprime with it so every band is taken
+  unsigned int stride = glm::max(1u, unsigned(count * 0.618f + 0.5f));
+  for (;; stride++) {
+    unsigned int a = stride;
+    unsigned int b = count;
+    while (b != 0) {
+      a = a % b;
+      std::swap(a, b);
+    }
+    if (a == 1) {
+      break;
+    }
+  }
+  for (unsigned int s = 0; s < count; s++) {
+    const unsigned int i = (s * stride) % count;
+    const float z = 1 - (2 * (i + band)) / static_cast<float>(count);
+    const float r = glm::sqrt(1 - z * z);
+    const float phi = golden * i + turn;
+    const glm::vec3 offset(r * glm::cos(phi), r * glm::sin(phi), z);
+    samples[s].pos = light.pos + view * glm::vec4(light.diffusion * offset, 0);
+  }
+  return samples;
+}
+
+// in HDR, see tonemap, lights are the samples of one light in camera space
+// and are weighted equally, only [first, first + count) of them are taken
+Estimate pathtrace_light(
     const Model &model,
     const std::vector<std::array<glm::vec4, 3>> &triangles, // camera space
-    const PointLight &light, glm::mat4 view, const glm::vec4 &ray,
-    const Intersection &intersection) {
-  std::vector<std::tuple<glm::vec3, float>> light_samples;
-
-  // should this have a different weighting?
-  const float cw = 1 / 6.f;
-  const float sw = (1 - cw) / 6.f;
-  light_samples.push_back(
-      std::make_tuple(light.diffusion * glm::vec3(+0.0f, +0.0f, +0.0f), cw));
-  light_samples.push_back(
-      std::make_tuple(light.diffusion * glm::vec3(+1.0f, +0.0f, +0.0f), sw));
-  light_samples.push_back(
-      std::make_tuple(light.diffusion * glm::vec3(+0.0f, +1.0f, +0.0f), sw));
-  light_samples.push_back(
-      std::make_tuple(light.diffusion * glm::vec3(+0.0f, +0.0f, +1.0f), sw));
-  light_samples.push_back(
-      std::make_tuple(light.diffusion * glm::vec3(-1.0f, +0.0f, +0.0f), sw));
-  light_samples.push_back(
-      std::make_tuple(light.diffusion * glm::vec3(+0.0f, -1.0f, +0.0f), sw));
-  light_samples.push_back(
-      std::make_tuple(light.diffusion * glm::vec3(+0.0f, +0.0f, -1.0f), sw));
-
-  glm::vec3 l_col(0);
-  for (const auto light_sample : light_samples) {
-    PointLight pl = light;
-    // absolutely disgusting, it would be much nicer for light.pos to
-    // be in glmt::vec3w
-    pl.pos = view * (glm::vec4(std::get<0>(light_sample), 0) +
-                     glm::inverse(view) * light.pos);
-
-    l_col += pathtrace_light(model, triangles, pl, ray, intersection) *
-             std::get<1>(light_sample);
-  }
-
-  return tm_aces(l_col);
-}
-
-void filledtriangle(sdw::window window, PointLight light,
-                    std::array<glmt::vec3s, 3> ss, std::array<glm::vec3, 3> cs,
-                    std::array<glm::vec3, 3> normals, glmt::rgbf01 colour) {
-
-  std::array<glmt::vec2s, 3> s_tri{glm::vec2(ss[0]), glm::vec2(ss[1]),
-                                   glm::vec2(ss[2])};
-  glmt::bound2s bounds(s_tri.begin(), s_tri.end());
-
-  bounds.min.x = glm::max(glm::floor(bounds.min.x), 0.f);
-  bounds.min.y = glm::max(glm::floor(bounds.min.y), 0.f);
-  bounds.max.x = glm::min(glm::ceil(bounds.max.x), (float)window.width);
-  bounds.max.y = glm::min(glm::ceil(bounds.max.y), (float)window.height);
-
-  for (int y = bounds.min.y; y <= bounds.max.y; y++) {
-    for (int x = bounds.min.x; x <= bounds.max.x; x++) {
-      glm::vec3 bc = barycentric(glmt::vec2s(x, y), s_tri);
-      if (bc[0] <= 0 || bc[1] <= 0 || bc[2] <= 0) {
-        // outside of triangle
-        continue;
-      }
+    const BVH &bvh, const std::vector<PointLight> &lights,
+    const glm::vec4 &ray, const Intersection &intersection, size_t first,
+    size_t count) {
+  Estimate l_col;
+  const size_t end = glm::min(first + count, lights.size());
+  // every shadow ray ends at the intersection, so they are close enough to
+  // trace as packets, the last one padded out with the last sample, stopping
+  // short so the intersection's own triangle is not in the way
+  for (size_t start = first; start < end; start += PACKET) {
+    Packet shadows;
+    for (unsigned int l = 0; l < PACKET; l++) {
+      const PointLight &light = lights[glm::min(start + l, end - 1)];
+      const glm::vec3 r = glm::vec3(-intersection.position + light.pos);
+      shadows.set(l, glm::vec3(light.pos), -glm::normalize(r));
+      shadows.distance[l] = glm::length(r) - SHADOW_BIAS;
+    }
+    occluded(shadows, bvh);
+
+    // the samples are spread evenly enough that shading converges well
+    // before shadows do, so it is only which ones are in shadow that counts
+    for (unsigned int l = 0; l < PACKET && start + l < end; l++) {
+      const bool lit = shadows.distance[l] >= 0;
+      l_col.add(pathtrace_light(model, triangles, lights[start + l], ray,
+                                intersection, lit),
+                lit);
+    }
+  }
 
-      float zinv = bc[0] / ss[0].z + bc[1] / ss[1].z + bc[2] / ss[2].z;
+  return l_col;
+}
 
-      glm::vec3 bcs;
-      {
-        // perspective corrected normal
-        for (int i = 0; i < 3; ++i) {
-          bcs += bc[i] * cs[i] / ss[i].z;
-        }
-        bcs /= zinv;
+void filledtriangle(sdw::framebuffer window, PointLight light,
+                    std::array<glmt::vec3s, 3> ss, std::array<glm::vec3, 3> cs,
+                    std::array<glm::vec3, 3> normals, glmt::rgbf01 colour) {
+  rasterise(window, ss, [&](const glm::vec3 &bc, float zinv) {
+    glm::vec3 bcs;
+    {
+      // perspective corrected normal
+      for (int i = 0; i < 3; ++i) {
+        bcs += bc[i] * cs[i] / ss[i].w;
       }
-      glm::vec3 bnormal(0);
-      {
-        // perspective corrected normal
-        for (int i = 0; i < 3; ++i) {
-          bnormal += bc[i] * normals[i] / ss[i].z;
-        }
-        bnormal /= zinv;
+      bcs /= zinv;
+    }
+    glm::vec3 bnormal(0);
+    {
+      // perspective corrected normal
+      for (int i = 0; i < 3; ++i) {
+        bnormal += bc[i] * normals[i] / ss[i].w;
       }
-
-      float d = glm::length(glm::vec3(light.pos) - bcs);
-      glm::vec3 r = glm::normalize(glm::vec3(light.pos) - bcs);
-      glm::vec3 n = bnormal;
-      glm::vec3 c = glm::normalize(bcs); // in camera space camera, so
-                                         // camera is at (0, 0)
-      glm::vec3 col = colour * phong(light, d, r, n, c);
-      glmt::rgbf01 tm_col = tm_aces(col);
-
-      window.setPixelColour(glmt::vec2p(x, y), zinv, tm_col.argb8888());
+      bnormal /= zinv;
     }
-  }
+
+    float d = glm::length(glm::vec3(light.pos) - bcs);
+    glm::vec3 r = glm::normalize(glm::vec3(light.pos) - bcs);
+    glm::vec3 n = bnormal;
+    glm::vec3 c = glm::normalize(bcs); // in camera space camera, so
+                                       // camera is at (0, 0)
+    return glm::vec3(colour * phong(light, d, r, n, c));
+  });
 }
\ No newline at end of file
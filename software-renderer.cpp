@@ -13,7 +13,9 @@
 #include <glm/gtx/io.hpp>
 
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <unistd.h>
 
 #define FPS (30.0)
 #define TIME (30.0)
@@ -26,19 +28,65 @@
 // 3 for 940x720
 // 6 for 1920x1440
 #define N (2)
-// a supersampled window which is 1/DS of the size, disabled by setting to 1
+// renders DS * DS samples per pixel and resolves them into a framebuffer 1/DS
+// of the size, which is post processed, presented and saved instead,
+// disabled by setting to 1
 #define DS (1)
+// how DS samples are resolved, FILTER::BOX or FILTER::TENT
+#define DS_FILTER (FILTER::BOX)
+// samples per pixel of the raster modes, 2, 4 or 8 for edges as smooth as a
+// DS of about the same without shading each pixel DS * DS times, disabled by
+// setting to 1
+#define MSAA (1)
+// smooths edges once the frame is tone mapped, for any mode and for a fraction
+// of the cost of DS or MSAA, the raymarch then takes one sample per pixel
+#define FXAA (false)
+// jitters the projection every frame and blends each frame into the last, one
+// sample per pixel per frame for edges as smooth as many, the raymarch then
+// takes one sample per pixel
+#define TAA (false)
 #define WIDTH (320 * N)
 #define HEIGHT (240 * N)
+// render fewer pixels while frames take longer than FRAME_BUDGET ms and
+// upscale them into the window, never when writing files as those should not
+// depend on how fast they were rendered
+#define DYNAMIC_RESOLUTION (RENDER && !WRITE_FILE)
+#define FRAME_BUDGET (1000.0 / FPS)
+#define MIN_SCALE (0.25)
+// 1 in SHADING_RATE pixels of PATHTRACE and raymarch are shaded each frame, 1,
+// 2 or 4, see shade_sparse
+#define SHADING_RATE (1)
+// points the light is sampled at by PATHTRACE, for softer shadows at the cost
+// of a shadow ray each, 1 is a point light
+#define LIGHT_SAMPLES (16)
+// adaptive sampling, PATHTRACE and raymarch pixels first take a packet of
+// shadow rays or FIRST_SAMPLES subpixel samples, and only the ones which have
+// not converged take the rest, the most uncertain first, for SAMPLE_BUDGET
+// more samples per pixel of the frame on average, see shade_adaptive
+#define FIRST_SAMPLES (2)
+#define SAMPLE_BUDGET (4)
+// while paused every frame is jittered and averaged with the ones before it,
+// starting over whenever anything drawn changes
+#define PROGRESSIVE (true)
 
 void setup();
 void draw();
 void update();
 void handleEvent(SDL_Event event);
+void rescale(float ms);
+void jitter(unsigned int i);
+void refine();
 
 // TODO: move into State struct
-sdw::window window;
-sdw::window supersampled;
+sdw::framebuffer framebuffer;
+sdw::framebuffer supersampled; // framebuffer resolved, if DS > 1
+// the last frame, swapped with output() every frame so one is uploaded while
+// the other is drawn, if RENDER
+sdw::framebuffer presented;
+sdw::window window; // presents output(), only opened if RENDER
+
+// the finished frame, what is post processed, presented and saved
+sdw::framebuffer &output() { return DS > 1 ? supersampled : framebuffer; }
 
 struct State {
   // std::tuple<std::array<glmt::vec2s, 3>, glmt::rgb888> unfilled_triangle;
@@ -50,8 +98,10 @@ struct State {
   Camera camera;
   glm::mat4 view;
   glm::mat4 proj;
+  glm::vec2 jitter; // pixels state.proj is moved by, see TAA
 
   PointLight light;
+  std::vector<PointLight> lights; // light sampled in camera space this frame
   bool raymarch = false;
 
   struct SDL_detail {
@@ -61,6 +111,44 @@ struct State {
   unsigned int frame = -1; // update called first which incremets frame
   unsigned int logic = -1;
   bool update = true; // logic is paused but frames keep advancing
+  float scale = 1;     // of WIDTH and HEIGHT being rendered
+
+  // shade_sparse scratch space for each model, then for the raymarch
+  std::vector<Sparse> sparse;
+
+  // camera space triangles of each PATHTRACE model and the BVH over them,
+  // only rebuilt when the view or the model's matrix changes
+  struct Geometry {
+    glm::mat4 modelview;
+    std::vector<std::array<glm::vec4, 3>> triangles;
+    BVH bvh;
+  };
+  std::vector<Geometry> geometry;
+
+  // fxaa scratch space
+  struct Post {
+    std::vector<uint32_t> colours;
+    std::vector<float> lumas;
+    std::vector<uint8_t> edges;
+  } post;
+
+  // taa history, and the view and projection it was drawn with
+  struct Temporal {
+    std::vector<glm::vec3> history;
+    glm::mat4 viewproj;
+  } temporal;
+
+  // frames summed while paused, and what was drawn when they started
+  struct Progressive {
+    std::vector<glm::vec4> hdr;
+    std::vector<glm::vec3> packed;
+    unsigned int count = 0;
+    glm::mat4 view;
+    glm::vec4 light;
+    std::vector<glm::mat4> matrices;
+    std::vector<Model::RenderMode> modes;
+    bool raymarch = false;
+  } progressive;
 } state;
 
 void setup() {
@@ -124,14 +212,18 @@ void setup() {
     state.models.push_back(model);
   }
 
-  window = sdw::window(WIDTH, HEIGHT, false);
+  framebuffer = sdw::framebuffer(WIDTH, HEIGHT, true, MSAA);
+  framebuffer.tonemap = tm_argb8888;
   if (DS > 1) {
-    supersampled = sdw::window(WIDTH / DS, HEIGHT / DS, false,
-                               "supersampled display window");
+    supersampled = sdw::framebuffer(WIDTH / DS, HEIGHT / DS);
+    supersampled.tonemap = tm_argb8888;
   }
-  if (!RENDER) {
-    // closed but not destroyed
-    window.close();
+  if (RENDER) {
+    presented = DS > 1 ? sdw::framebuffer(WIDTH / DS, HEIGHT / DS)
+                       : sdw::framebuffer(WIDTH, HEIGHT, true, MSAA);
+    presented.tonemap = tm_argb8888;
+    // headless otherwise, SDL is never initialised
+    window = sdw::window(output(), false);
   }
   if (WRITE_FILE) {
     std::cout << "Saving " << FRAMES << " frames at " << FPS << " fps totaling "
@@ -144,16 +236,31 @@ int main(int argc, char *argv[]) {
   setup();
 
   SDL_Event event;
+  std::string written; // the last PPM written
+  auto last = std::chrono::high_resolution_clock::now();
   while (true) {
     // We MUST poll for events - otherwise the window will freeze !
-    if (window.pollForInputEvents(&event)) {
+    if (RENDER && window.pollForInputEvents(&event)) {
       handleEvent(event);
     }
     update();
+    if (RENDER) {
+      // the last frame is still being copied out of what is now presented
+      std::swap(output(), presented);
+    }
     draw();
+    // shared by the upload and the PPM, damage() only reports changes once
+    const std::vector<sdw::framebuffer::rect> damage =
+        RENDER ? output().damage(presented) : output().damage();
 
     if (RENDER) {
-      window.renderFrame();
+      window.renderFrame(damage);
+    }
+
+    if (DYNAMIC_RESOLUTION) {
+      auto now = std::chrono::high_resolution_clock::now();
+      rescale(std::chrono::duration<float, std::milli>(now - last).count());
+      last = now;
     }
 
     if (WRITE_FILE && state.frame < FRAMES) { // save frame as PPM
@@ -178,28 +285,38 @@ int main(int argc, char *argv[]) {
                   << std::endl;
       }
 
+      std::stringstream filename;
+      filename << "PPM/frame" << std::setfill('0') << std::setw(5)
+               << state.frame << ".ppm";
+      // std::cout << filename.str() << std::endl;
+
+      // never write through a link left by an earlier run
+      std::remove(filename.str().c_str());
+      if (damage.empty() && !written.empty() &&
+          link(written.c_str(), filename.str().c_str()) == 0) {
+        // an unchanged frame shares the last frame's file
+        continue;
+      }
+      written = filename.str();
+
       glmt::PPM ppm;
-      ppm.header.width = window.width;
-      ppm.header.height = window.height;
+      ppm.header.width = output().width;
+      ppm.header.height = output().height;
       ppm.header.maxval = 255;
       ppm.reserve();
 
       // COPY
-      for (unsigned int y = 0; y < window.height; y++) {
-        for (unsigned int x = 0; x < window.width; x++) {
+      for (unsigned int y = 0; y < output().height; y++) {
+        for (unsigned int x = 0; x < output().width; x++) {
           // to glm::vec3, dropping the alpha channel then divide by 255.f
           glmt::rgbf01 curr =
-              glm::vec3(window.getPixelColour(glmt::vec2p(x, y))) / 255.f;
+              glm::vec3(output().getPixelColour(glmt::vec2p(x, y))) / 255.f;
 
           ppm[glmt::vec2t(x, y)] = curr;
         }
       }
 
       // WRITE
-      std::stringstream filename;
-      filename << "PPM/frame" << std::setfill('0') << std::setw(5)
-               << state.frame << ".ppm";
-      // std::cout << filename.str() << std::endl;
       std::ofstream file(filename.str());
       file << ppm;
     } else if (EXIT_AFTER_WRITE) {
@@ -220,7 +337,11 @@ int main(int argc, char *argv[]) {
                        std::chrono::duration_cast<std::chrono::seconds>(t2 - t1)
                            .count()
                 << std::endl;
-      window.destroy();
+      if (RENDER) {
+        window.destroy();
+        presented.destroy();
+      }
+      framebuffer.destroy();
       exit(0);
     }
   }
@@ -385,17 +506,55 @@ float ao(const glmt::vec3w pos, const float e) {
 }
 
 void draw() {
-  window.clearPixels();
-  window.clearDepthBuffer();
+  const glm::vec4 viewport(0, 0, framebuffer.width, framebuffer.height);
+
+  framebuffer.clearPixels();
+  framebuffer.clearDepthBuffer();
+
+  state.sparse.resize(state.models.size() + 1);
+  state.geometry.resize(state.models.size());
+  // refining takes a different set every frame
+  const bool refining = PROGRESSIVE && !state.update;
+  state.lights = sample_light(state.light, state.view, LIGHT_SAMPLES,
+                              refining ? state.progressive.count : 0);
+  // extra samples, shared by everything drawn
+  size_t budget = SAMPLE_BUDGET * framebuffer.width * framebuffer.height;
 
   // TODO: AoS to SoA
   for (const auto &model : state.models) {
+    Sparse &sparse = state.sparse[&model - &state.models[0]];
     if (model.mode == Model::RenderMode::PATHTRACE) {
       // float focalLength =
       //     (HEIGHT / 2) *
       //     glm::tan(glm::radians(90.f / 2.0f));
       glm::vec4 cameraPos = glm::vec4(0, 0, 0, 1); // camera in camera space
 
+      // the same for every ray, and often for every frame, so transform and
+      // build the BVH once and share them between the ray threads
+      State::Geometry &geometry = state.geometry[&model - &state.models[0]];
+      const glm::mat4 modelview = state.view * model.matrix;
+      if (modelview != geometry.modelview ||
+          geometry.triangles.size() != model.triangles.size()) {
+        geometry.modelview = modelview;
+        geometry.triangles.clear();
+        geometry.triangles.reserve(model.triangles.size());
+        for (const auto &triangle : model.triangles) {
+          std::array<glm::vec4, 3> ts;
+          for (size_t i = 0; i < ts.size(); ++i) {
+            ts[i] = modelview * triangle[i];
+          }
+          geometry.triangles.push_back(ts);
+        }
+        geometry.bvh = BVH(geometry.triangles);
+      }
+      const std::vector<std::array<glm::vec4, 3>> &triangles =
+          geometry.triangles;
+      const BVH &bvh = geometry.bvh;
+
+      // the projection moves with the jitter and resolution, so is redone
+      std::vector<std::array<glmt::vec3s, 3>> projected;
+      projected.reserve(triangles.size());
+
       glmt::bound2s bounds;
       {
         glm::vec2 max(std::numeric_limits<float>::lowest());
@@ -403,59 +562,77 @@ void draw() {
         // TODO: figure out how many points in the BB of the model are required
         // for the affine transformation proj when converting to vec2s, but for
         // now a few matrix multiplcations are not that expensive
-        for (const auto &triangle : model.triangles) {
-          for (const glmt::vec3l point : triangle) {
-            glm::vec3 ss = glm::project(
-                glm::vec3(point), state.view * model.matrix, state.proj,
-                glm::vec4(0, 0, window.width, window.height));
-            max = glm::max(max, glm::vec2(ss));
-            min = glm::min(min, glm::vec2(ss));
+        for (const auto &ts : triangles) {
+          std::array<glmt::vec3s, 3> ss;
+
+          for (size_t i = 0; i < ts.size(); ++i) {
+            ss[i] = glm::vec4(glm::project(glm::vec3(ts[i]), glm::mat4(1),
+                                           state.proj, viewport),
+                              1);
+            max = glm::max(max, glm::vec2(ss[i]));
+            min = glm::min(min, glm::vec2(ss[i]));
           }
+
+          projected.push_back(ss);
         }
 
         bounds.min = glm::max(glm::floor(min), 0.f);
         bounds.max =
-            glm::min(glm::ceil(max), glm::vec2(window.width, window.height));
+            glm::min(glm::ceil(max),
+                     glm::vec2(framebuffer.width - 1, framebuffer.height - 1));
       }
 
-#pragma omp parallel for collapse(2)
-      for (int y = bounds.min.y; y <= bounds.max.y; y++) {
-        for (int x = bounds.min.x; x <= bounds.max.x; x++) {
-          // glm::vec4 ray(((float)x - window.width / 2.0),
-          //               ((float)y - window.height / 2.0), -focalLength, 0.0);
-          glm::vec4 ray = glm::vec4(
-              glm::unProject(glm::vec3(x, y, 1), glm::mat4(1.0), state.proj,
-                             glm::vec4(0, 0, window.width, window.height)),
-              0);
-
-          Intersection intersection;
-          std::vector<std::array<glm::vec4, 3>> triangles;
-
-          std::transform(model.triangles.begin(), model.triangles.end(),
-                         std::back_inserter(triangles),
-                         [=](std::array<glmt::vec3l, 3> triangle)
-                             -> std::array<glm::vec4, 3> {
-                           std::array<glm::vec4, 3> ts;
-
-                           for (size_t i = 0; i < ts.size(); ++i) {
-                             ts[i] = state.view * model.matrix * triangle[i];
-                           }
-
-                           return ts;
-                         });
-
-          if (ClosestIntersection(cameraPos, glm::normalize(ray), triangles,
-                                  intersection)) {
-            glm::vec3 p = glm::project(
-                glm::vec3(intersection.position), glm::mat4(1), state.proj,
-                glm::vec4(0, 0, window.width, window.height));
-            window.setPixelColour(glmt::vec2p(x, y), 1.f / p.z,
-                                  pathtrace_light(model, triangles, state.light,
-                                                  state.view, ray, intersection)
-                                      .argb8888());
-          }
+      // only pixels covered by the model get a ray
+      const std::vector<Fragment> fragments =
+          coverage(triangles, projected, bounds);
+
+      auto trace = [&](size_t f, unsigned int first, unsigned int count) {
+        const unsigned int x = fragments[f].pos.x;
+        const unsigned int y = fragments[f].pos.y;
+        // glm::vec4 ray(((float)x - framebuffer.width / 2.0),
+        //               ((float)y - framebuffer.height / 2.0), -focalLength,
+        //               0.0);
+        glm::vec4 ray =
+            glm::vec4(glm::unProject(glm::vec3(x, y, 1), glm::mat4(1.0),
+                                     state.proj, viewport),
+                      0);
+
+        Intersection intersection;
+        const int id = fragments[f].triangleIndex;
+
+        // the raster already found the closest triangle, fall back to testing
+        // everything if the ray just misses it on an edge
+        bool hit = id != -1 && intersect(cameraPos, glm::normalize(ray),
+                                         triangles[id], intersection);
+        if (hit) {
+          intersection.triangleIndex = id;
+        } else {
+          hit = ClosestIntersection(cameraPos, glm::normalize(ray), bvh,
+                                    intersection);
+        }
+
+        Shade shade;
+        shade.hit = hit;
+        if (hit) {
+          shade.invz = 1.f / -intersection.position.z;
+          const Estimate estimate = pathtrace_light(
+              model, triangles, bvh, state.lights, ray, intersection, first,
+              count);
+          shade.colour = estimate.mean();
+          shade.samples = estimate.count;
+          shade.error = estimate.error();
         }
+        return shade;
+      };
+
+      std::vector<glmt::vec2p> pixels(fragments.size());
+      for (size_t f = 0; f < fragments.size(); f++) {
+        pixels[f] = fragments[f].pos;
       }
+      // the first samples fill a packet
+      shade_sparse(framebuffer, pixels, trace, state.frame, SHADING_RATE,
+                   glm::min<unsigned int>(PACKET, LIGHT_SAMPLES),
+                   LIGHT_SAMPLES, budget, sparse);
 
     } else {
       for (size_t i = 0; i < model.triangles.size(); i++) {
@@ -477,13 +654,14 @@ void draw() {
           // ss += glm::vec4(0.5, 0.5, 0, 0);
           // ss += glm::vec4(0, 0, 0,
           //                 0); // glm::vec4(viewport[0], viewport[1], 0, 0);
-          // ss *= glm::vec4(window.width, window.height, 1,
+          // ss *= glm::vec4(framebuffer.width, framebuffer.height, 1,
           //                 1); // glm::vec4(viewport[2], viewport[3], 1, 1);
 
+          // w is the depth in view space, 1/w of which is what the
+          // framebuffer depth tests
           glm::vec4 ss = glm::vec4(
-              glm::project(glm::vec3(cs), glm::mat4(1), state.proj,
-                           glm::vec4(0, 0, window.width, window.height)),
-              1);
+              glm::project(glm::vec3(cs), glm::mat4(1), state.proj, viewport),
+              -cs.z);
 
           transformedc[t] = cs;
           transformed[t] = ss;
@@ -491,11 +669,13 @@ void draw() {
         }
 
         if (model.mode == Model::RenderMode::WIREFRAME) {
-          linetriangle(window, std::make_tuple(transformed, model.colours[i]));
+          linetriangle(framebuffer,
+                       std::make_tuple(transformed, model.colours[i]));
         } else if (model.mode == Model::RenderMode::WIREFRAME_AA) {
-          linetriangle(window, std::make_tuple(transformed2, model.colours[i]));
+          linetriangle(framebuffer,
+                       std::make_tuple(transformed2, model.colours[i]));
         } else if (model.mode == Model::RenderMode::FILL) {
-          filledtriangle(window,
+          filledtriangle(framebuffer,
                          std::make_tuple(transformed2, model.colours[i]));
         } else if (model.mode == Model::RenderMode::RASTERISE_GOURAD) {
           std::array<glm::vec3, 3> normals;
@@ -507,7 +687,7 @@ void draw() {
             cs[j] = glm::vec3(transformedc[j]);
           }
 
-          filledtriangle(window, state.light, transformed, cs, normals,
+          filledtriangle(framebuffer, state.light, transformed, cs, normals,
                          model.colours[i]);
 
         } else if (model.mode == Model::RenderMode::RASTERISE_VERTEX) {
@@ -527,7 +707,7 @@ void draw() {
             colours[j] = model.colours[i] * phong(state.light, d, r, n, c);
           }
 
-          filledtriangle(window, transformed, colours);
+          filledtriangle(framebuffer, transformed, colours);
         }
       }
     }
@@ -541,163 +721,277 @@ void draw() {
 
     // const glmt::vec3w start = glm::inverse(state.view) * glm::vec4(0, 0, 0,
     // 1);
-    const glmt::vec3w start =
-        glm::vec4(glm::unProject(glm::vec3(0, 0, 0), state.view, state.proj,
-                                 glm::vec4(0, 0, window.width, window.height)),
-                  1);
-
-#pragma omp parallel for collapse(2)
-    for (unsigned int y = 0; y < window.height; y++) {
-      for (unsigned int x = 0; x < window.width; x++) {
-        std::vector<glm::vec2> samples;
-
-        float angle = glm::radians(30.0f);
-        samples.push_back(glm::rotate(glm::vec2(+0.00, +0.00), angle));
-        samples.push_back(glm::rotate(glm::vec2(-0.25, -0.25), angle));
-        samples.push_back(glm::rotate(glm::vec2(-0.25, +0.25), angle));
-        samples.push_back(glm::rotate(glm::vec2(+0.25, -0.25), angle));
-        samples.push_back(glm::rotate(glm::vec2(+0.25, +0.25), angle));
-
-        // // random samples
-        // for (size_t s = 0; s < 4; s++) {
-        //   const glm::vec2 sd = glm::vec2(0.5f / 3.0f);
-        //   samples.push_back(glm::gaussRand(glm::vec2(0), sd));
-        //   // samples.push_back(
-        //   //     glm::linearRand(glm::vec2(-0.5, -0.5), glm::vec2(0.5,
-        //   // 0.5)));
-        // }
-
-        // no sampling
-        // samples.push_back(glm::vec2(0));
-
+    const glmt::vec3w start = glm::vec4(
+        glm::unProject(glm::vec3(0, 0, 0), state.view, state.proj, viewport),
+        1);
+
+    std::vector<glm::vec2> samples;
+    if (FXAA || TAA) {
+      // edges are smoothed after instead
+      samples.push_back(glm::vec2(0));
+    } else {
+      // opposite corners first, so the first two already span the pixel
+      float angle = glm::radians(30.0f);
+      samples.push_back(glm::rotate(glm::vec2(-0.25, -0.25), angle));
+      samples.push_back(glm::rotate(glm::vec2(+0.25, +0.25), angle));
+      samples.push_back(glm::rotate(glm::vec2(+0.00, +0.00), angle));
+      samples.push_back(glm::rotate(glm::vec2(-0.25, +0.25), angle));
+      samples.push_back(glm::rotate(glm::vec2(+0.25, -0.25), angle));
+    }
+    const unsigned int first =
+        glm::min<unsigned int>(FIRST_SAMPLES, samples.size());
+
+    // samples [first, first + count) of pixel (x, y)
+    auto march_pixel = [&](unsigned int x, unsigned int y, unsigned int first,
+                           unsigned int count) {
+
+      // // random samples
+      // for (size_t s = 0; s < 4; s++) {
+      //   const glm::vec2 sd = glm::vec2(0.5f / 3.0f);
+      //   samples.push_back(glm::gaussRand(glm::vec2(0), sd));
+      //   // samples.push_back(
+      //   //     glm::linearRand(glm::vec2(-0.5, -0.5), glm::vec2(0.5,
+      //   // 0.5)));
+      // }
+
+      // no sampling
+      // samples.push_back(glm::vec2(0));
+
+      Estimate estimate;
+      float zinv = 0;
+      for (unsigned int s = first; s < first + count; s++) {
+        const glm::vec2 sample = samples[s];
         glm::vec3 col(0);
-        float zinv = 0;
-        for (const auto sample : samples) {
-          const glm::vec4 ray = glm::vec4(
-              glm::normalize(glm::unProject(
-                  glm::vec3(glm::vec2(x, y) + sample, 1), state.view,
-                  state.proj, glm::vec4(0, 0, window.width, window.height))),
-              0);
-
-          float dist = march(start, ray, MIN_DIST, MAX_DIST, MAX_MARCHING_STEPS,
-                             EPSILON);
-
-          if (dist > MAX_DIST - EPSILON) {
-            // https://www.scratchapixel.com/lessons/procedural-generation-virtual-worlds/simulating-sky
-            glm::vec3 rd = glm::vec3(ray.x, -ray.y, ray.z);
-            float yd = glm::min(rd.y, 0.0f);
-            rd.y = glm::max(rd.y, 0.0f);
-
-            glm::vec3 sky_col(0.0f);
-            sky_col += glm::vec3(0.3f, 0.5f, 0.6f) *
-                       (1.0f - glm::exp(-rd.y * 8.0f)) *
-                       glm::exp(rd.y * 0.9f); // blue sky
-            sky_col +=
-                glm::vec3(0.4f, 0.4f - glm::exp(-rd.y * 20.0f) * 0.3f, 0.0f) *
-                exp(-rd.y * 9.0f); // yellowy sky
-            sky_col = glm::mix(sky_col * 1.2f, state.light.ambient(),
-                               1.0f - glm::exp(yd * 100.0f)); // ground fog
-
-            col += sky_col;
-          } else {
-            const glmt::vec3c pos = state.view * (start + dist * ray);
-            const float d =
-                glm::length(glm::vec3(state.light.pos) - glm::vec3(pos));
-            const glm::vec3 r =
-                glm::normalize(glm::vec3(state.light.pos) - glm::vec3(pos));
-            const glm::vec3 n = normal(start + dist * ray, EPSILON);
-            const glm::vec3 c = glm::normalize(glm::vec3(pos));
-
-            glm::vec3 z =
-                glm::project(glm::vec3(pos), glm::mat4(1), state.proj,
-                             glm::vec4(0, 0, window.width, window.height));
-
-            std::vector<std::tuple<glm::vec3, float>> light_samples;
-            light_samples.push_back(std::make_tuple(glm::vec3(0), 1));
-            glm::vec3 l_col(0);
-            for (const auto light_sample : light_samples) {
-              PointLight light = state.light;
-              // absolutely disgusting, it would be much nicer for light.pos to
-              // be in glmt::vec3w
-              light.pos =
-                  state.view * (glm::vec4(std::get<0>(light_sample), 0) +
-                                glm::inverse(state.view) * light.pos);
-
-              const float x = dist / static_cast<float>(MAX_DIST);
-              l_col += glm::mix(std::get<1>(light_sample) *
-                                    colour(start + dist * ray) *
-                                    // ao(start + dist * ray, EPSILON) *
-                                    phong(light, d, r, n, c),
-                                glm::vec3(0), x * x);
-            }
-            col += l_col / static_cast<float>(light_samples.size());
-            zinv += 1.f / z.z;
+        const glm::vec4 ray = glm::vec4(
+            glm::normalize(
+                glm::unProject(glm::vec3(glm::vec2(x, y) + sample, 1),
+                               state.view, state.proj, viewport)),
+            0);
+
+        float dist = march(start, ray, MIN_DIST, MAX_DIST, MAX_MARCHING_STEPS,
+                           EPSILON);
+
+        if (dist > MAX_DIST - EPSILON) {
+          // https://www.scratchapixel.com/lessons/procedural-generation-virtual-worlds/simulating-sky
+          glm::vec3 rd = glm::vec3(ray.x, -ray.y, ray.z);
+          float yd = glm::min(rd.y, 0.0f);
+          rd.y = glm::max(rd.y, 0.0f);
+
+          glm::vec3 sky_col(0.0f);
+          sky_col += glm::vec3(0.3f, 0.5f, 0.6f) *
+                     (1.0f - glm::exp(-rd.y * 8.0f)) *
+                     glm::exp(rd.y * 0.9f); // blue sky
+          sky_col +=
+              glm::vec3(0.4f, 0.4f - glm::exp(-rd.y * 20.0f) * 0.3f, 0.0f) *
+              exp(-rd.y * 9.0f); // yellowy sky
+          sky_col = glm::mix(sky_col * 1.2f, state.light.ambient(),
+                             1.0f - glm::exp(yd * 100.0f)); // ground fog
+
+          col += sky_col;
+        } else {
+          const glmt::vec3c pos = state.view * (start + dist * ray);
+          const float d =
+              glm::length(glm::vec3(state.light.pos) - glm::vec3(pos));
+          const glm::vec3 r =
+              glm::normalize(glm::vec3(state.light.pos) - glm::vec3(pos));
+          const glm::vec3 n = normal(start + dist * ray, EPSILON);
+          const glm::vec3 c = glm::normalize(glm::vec3(pos));
+
+          std::vector<std::tuple<glm::vec3, float>> light_samples;
+          light_samples.push_back(std::make_tuple(glm::vec3(0), 1));
+          glm::vec3 l_col(0);
+          for (const auto light_sample : light_samples) {
+            PointLight light = state.light;
+            // absolutely disgusting, it would be much nicer for light.pos to
+            // be in glmt::vec3w
+            light.pos =
+                state.view * (glm::vec4(std::get<0>(light_sample), 0) +
+                              glm::inverse(state.view) * light.pos);
+
+            const float x = dist / static_cast<float>(MAX_DIST);
+            l_col += glm::mix(std::get<1>(light_sample) *
+                                  colour(start + dist * ray) *
+                                  // ao(start + dist * ray, EPSILON) *
+                                  phong(light, d, r, n, c),
+                              glm::vec3(0), x * x);
           }
+          col += l_col / static_cast<float>(light_samples.size());
+          zinv += 1.f / -pos.z;
         }
+        estimate.add(col);
+      }
 
-        col /= samples.size();
-        zinv /= samples.size();
-
-        glmt::rgbf01 tm = tm_aces(col);
-        window.setPixelColour(glmt::vec2p(x, y), zinv, tm.argb8888());
+      Shade shade;
+      shade.colour = estimate.mean();
+      shade.invz = zinv / count;
+      shade.hit = true; // the sky where nothing is hit
+      shade.samples = count;
+      shade.error = estimate.error();
+      return shade;
+    };
+
+    Sparse &sparse = state.sparse.back();
+    if (SHADING_RATE == 1) {
+      const unsigned int width = framebuffer.width;
+      std::vector<Shade> &shades = sparse.samples;
+      shades.resize(width * framebuffer.height);
+#pragma omp parallel for
+      for (unsigned int y = 0; y < framebuffer.height; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+          shades[y * width + x] = march_pixel(x, y, 0, first);
+        }
+      }
+      shade_adaptive(
+          shades.size(), [&](size_t i) { return &shades[i]; },
+          [&](size_t i, unsigned int first, unsigned int count) {
+            return march_pixel(i % width, i / width, first, count);
+          },
+          first, samples.size(), budget);
+#pragma omp parallel for
+      for (unsigned int y = 0; y < framebuffer.height; y++) {
+        const sdw::framebuffer::span row = framebuffer.row(y, 0, width - 1);
+        for (unsigned int x = 0; x < width; x++) {
+          row.set(x, shades[y * width + x].invz, shades[y * width + x].colour);
+        }
+      }
+    } else {
+      std::vector<glmt::vec2p> pixels;
+      pixels.reserve(framebuffer.width * framebuffer.height);
+      for (unsigned int y = 0; y < framebuffer.height; y++) {
+        for (unsigned int x = 0; x < framebuffer.width; x++) {
+          pixels.push_back(glmt::vec2p(x, y));
+        }
       }
+      shade_sparse(
+          framebuffer, pixels,
+          [&](size_t i, unsigned int first, unsigned int count) {
+            return march_pixel(pixels[i].x, pixels[i].y, first, count);
+          },
+          state.frame, SHADING_RATE, first, samples.size(), budget, sparse);
     }
   } // end raymarch
 
   { // light
-    glm::vec3 light =
-        glm::project(glm::vec3(state.light.pos), glm::mat4(1), state.proj,
-                     glm::vec4(0, 0, window.width, window.height));
+    glm::vec3 light = glm::project(glm::vec3(state.light.pos), glm::mat4(1),
+                                   state.proj, viewport);
 
     for (int lx = -N + 1; lx < N; lx++) {
       for (int ly = -N + 1; ly < N; ly++) {
-        // window.setPixelColour(glmt::vec2p(light + glm::vec3(lx, ly, 0)),
+        // framebuffer.setPixelColour(glmt::vec2p(light + glm::vec3(lx, ly, 0)),
         // glmt::rgbf01(1.f).argb8888());
-        window.setPixelColour(glmt::vec2p(light + glm::vec3(lx, ly, 0)),
-                              1.f / light.z, glmt::rgbf01(1.f).argb8888());
+        framebuffer.setPixelColour(glmt::vec2p(light + glm::vec3(lx, ly, 0)),
+                              1.f / -state.light.pos.z,
+                              glmt::rgbf01(1.f).argb8888());
       }
     }
 
   } // end light
 
-  if (DS > 1) {
-#pragma omp parallel for collapse(2)
-    for (unsigned int y = 0; y < supersampled.height; y++) {
-      for (unsigned int x = 0; x < supersampled.width; x++) {
-        std::array<glmt::vec2p, DS * DS> samples;
-        {
-          size_t i = 0;
-          for (int sx = 0; sx < DS; sx++) {
-            for (int sy = 0; sy < DS; sy++) {
-              samples[i] = glmt::vec2p(sx, sy);
-              i++;
-            }
-          }
-        }
+  framebuffer.resolveSamples();
+  if (refining) {
+    // in HDR, so it is the mean which is tone mapped
+    accumulate(framebuffer, state.progressive.hdr, state.progressive.packed,
+               state.progressive.count);
+  }
 
-        // should really do this before tone mapping
-        // or at least invert the tone map, sum and reapply
-        glmt::rgbf01 col(0);
-        glmt::vec2p pos(x, y);
+  if (DS > 1) {
+    // tone maps the mean of each pixel's HDR samples as it goes
+    downsample<DS, DS_FILTER>(framebuffer, supersampled);
+  } else {
+    tonemap(framebuffer);
+  }
+  sdw::framebuffer &frame = output();
+  if (TAA) {
+    const glm::vec2 size(frame.width, frame.height);
+    const glm::mat4 viewproj =
+        glm::translate(glm::vec3(-2.f * state.jitter / size, 0)) * state.proj *
+        state.view;
+    taa(frame, viewproj, state.temporal.viewproj, state.jitter,
+        state.temporal.history);
+    state.temporal.viewproj = viewproj;
+  }
+  if (FXAA) {
+    fxaa(frame, state.post.colours, state.post.lumas, state.post.edges);
+  }
+}
 
-        for (const auto sample : samples) {
-          glmt::vec2p s_pos = pos + sample;
-          col += glm::vec3(window.getPixelColour(s_pos));
-        }
+// steers the resolution towards FRAME_BUDGET, frame time goes with the number
+// of pixels so with the square of the scale
+void rescale(float ms) {
+  const float ratio = FRAME_BUDGET / ms;
+  if (ratio > 0.9f && ratio < 1.1f) {
+    return; // close enough, resizing every frame would shimmer
+  }
+  // small steps, as the odd slow frame should not halve the resolution
+  state.scale *= glm::clamp(glm::sqrt(ratio), 0.8f, 1.1f);
+  state.scale = glm::clamp(state.scale, float(MIN_SCALE), 1.f);
 
-        col /= samples.size();
-        supersampled.setPixelColour(pos, col.argb8888());
-      }
+  const unsigned int width = glm::round(WIDTH * state.scale);
+  const unsigned int height = glm::round(HEIGHT * state.scale);
+  if (width != framebuffer.width || height != framebuffer.height) {
+    if (RENDER) {
+      // resizing marks every tile stale, the copy of the last frame has to be
+      // done reading them first
+      window.presentFrame();
+    }
+    framebuffer.resize(width, height);
+    if (DS > 1) {
+      supersampled.resize(width / DS, height / DS);
+    }
+    if (RENDER) {
+      presented.resize(output().width, output().height);
     }
   }
 }
 
+// moves state.proj by sub-pixel offset i of the halton (2, 3) sequence, any
+// run of which covers the pixel evenly, in pixels of output() as those are
+// what TAA and progressive refinement blend
+void jitter(unsigned int i) {
+  const glm::vec2 offset = glm::vec2(halton(i, 2), halton(i, 3)) - 0.5f;
+  const glm::vec2 size(output().width, output().height);
+  // in clip space, where the width and height of the window are both 2
+  state.proj =
+      glm::translate(glm::vec3(2.f * (offset - state.jitter) / size, 0)) *
+      state.proj;
+  state.jitter = offset;
+}
+
+// starts progressive refinement over if anything drawn changed since the
+// last frame, then jitters the projection for its next sample
+void refine() {
+  State::Progressive &p = state.progressive;
+  std::vector<glm::mat4> matrices;
+  std::vector<Model::RenderMode> modes;
+  for (const Model &model : state.models) {
+    matrices.push_back(model.matrix);
+    modes.push_back(model.mode);
+  }
+  if (p.view != state.view || p.light != glm::vec4(state.light.pos) ||
+      p.matrices != matrices || p.modes != modes ||
+      p.raymarch != state.raymarch) {
+    p.count = 0;
+    p.view = state.view;
+    p.light = state.light.pos;
+    p.matrices = matrices;
+    p.modes = modes;
+    p.raymarch = state.raymarch;
+  }
+  jitter(p.count + 1);
+}
+
 void update() {
   state.frame++;
 
   if (!state.update) {
+    if (PROGRESSIVE) {
+      refine();
+    } else if (TAA) {
+      jitter(state.frame % 8 + 1); // keeps converging while paused
+    }
     return;
   }
+  state.progressive.count = 0;
 
   state.logic++;
 
@@ -766,8 +1060,14 @@ void update() {
   state.camera.dist = 5.7 + (2 * glm::clamp(state.logic / FRAMES, 0.0, 1.0));
 
   state.view = state.camera.view();
-  state.proj = glm::perspectiveFov(state.camera.fov, (float)window.width,
-                                   (float)window.height, 0.1f, 100.0f);
+  // over the planes the depth formats are built for
+  state.proj = glm::perspectiveFov(
+      state.camera.fov, (float)framebuffer.width, (float)framebuffer.height,
+      float(sdw::DEPTH_NEAR), float(sdw::DEPTH_FAR));
+  state.jitter = glm::vec2(0);
+  if (TAA) {
+    jitter(state.frame % 8 + 1);
+  }
 
   for (size_t i = 0; i < state.models.size(); ++i) {
     glm::mat4 fun = glm::rotate(
@@ -833,16 +1133,16 @@ void handleEvent(SDL_Event event) {
       std::cout << "[DEBUG] saving frame to file debug.ppm" << std::endl;
 
       glmt::PPM debug_ppm;
-      debug_ppm.header.width = window.width;
-      debug_ppm.header.height = window.height;
+      debug_ppm.header.width = output().width;
+      debug_ppm.header.height = output().height;
       debug_ppm.header.maxval = 255;
       debug_ppm.reserve();
 
       // COPY
-      for (unsigned int y = 0; y < window.height; y++) {
-        for (unsigned int x = 0; x < window.width; x++) {
+      for (unsigned int y = 0; y < output().height; y++) {
+        for (unsigned int x = 0; x < output().width; x++) {
           glmt::rgbf01 curr =
-              glm::vec3(window.getPixelColour(glmt::vec2p(x, y))) / 255.f;
+              glm::vec3(output().getPixelColour(glmt::vec2p(x, y))) / 255.f;
 
           debug_ppm[glmt::vec2t(x, y)] = curr;
         }
@@ -898,12 +1198,16 @@ void handleEvent(SDL_Event event) {
     break;
   case SDL_MOUSEBUTTONDOWN: {
     state.sdl.mouse_down = true;
-    glm::vec2 pos{event.button.x, event.button.y};
+    // from window to framebuffer pixels, which differ with DYNAMIC_RESOLUTION
+    // and DS
+    glm::vec2 pos =
+        glm::vec2(event.button.x, event.button.y) * state.scale * float(DS);
     std::cout << "MOUSE DOWN { " << pos << " }" << std::endl;
 
-    glm::vec3 ws = glm::unProject(glm::vec3(pos, window.getDepthBuffer(pos)),
-                                  state.view, state.proj,
-                                  glm::vec4(0, 0, window.width, window.height));
+    const float invz = framebuffer.getDepthBuffer(pos);
+    glm::vec3 ws = glm::unProject(
+        glm::vec3(pos, invz > 0 ? sdw::window_z(invz) : 1), state.view,
+        state.proj, glm::vec4(0, 0, framebuffer.width, framebuffer.height));
     std::cout << "ws: " << ws << std::endl;
 
     break;
@@ -923,7 +1227,7 @@ void handleEvent(SDL_Event event) {
       glmt::vec2s rel{event.motion.xrel, event.motion.yrel};
       glmt::vec2s end = start + rel;
 
-      line(window, start, end, colour);
+      line(framebuffer, start, end, colour);
     }
 
     break;